@@ -0,0 +1,606 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "commands.h"
+#include "disk.h"
+#include "filesystem.h"
+#include "workpool.h"
+
+// Bytes moved by each read or write on the filesystem
+static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+struct Options {
+	std::string_view filesystem_;
+	std::string_view geometry_;
+};
+
+// Layouts of the images made from scratch, the first one of a filesystem
+// is its default
+struct Geometry {
+	std::string_view name_;
+	std::string_view filesystem_;
+	unsigned int tracks_{};
+	unsigned int heads_{};
+	unsigned int sectors_{};
+	unsigned int sectorSize_{};
+};
+
+// clang-format off
+static constexpr auto geometries = std::to_array<Geometry>({
+	{"hc640" , "hc" , 80, 2, 16, 256},
+	{"cpm720", "cpm", 80, 2,  9, 512},
+});
+// clang-format on
+
+// The geometry named by the options or else the filesystem's default,
+// nullptr if there is none
+static const Geometry* geometry(const Options& options)
+{
+	for (const auto& geometry : geometries) {
+		if (options.geometry_.empty() ? geometry.filesystem_ == options.filesystem_ : geometry.name_ == options.geometry_)
+			return &geometry;
+	}
+
+	return nullptr;
+}
+
+static int fail(std::string_view what, int err)
+{
+	std::cerr << "Error: " << what << ": " << std::strerror(-err) << "\n";
+
+	return EXIT_FAILURE;
+}
+
+static int copyOut(Filesystem& filesystem, fuse_ino_t ino, std::ostream& out)
+{
+	struct fuse_file_info info{};
+
+	auto ret = filesystem.open(ino, &info);
+	if (ret < 0)
+		return ret;
+
+	std::vector<char> buf(CHUNK_SIZE);
+
+	for (off_t offset = 0;; offset += ret) {
+		const Filesystem::RequestScope scope;
+
+		ret = filesystem.read(ino, buf.data(), buf.size(), offset, &info);
+		if (ret <= 0)
+			break;
+
+		if (!out.write(buf.data(), ret)) {
+			ret = -EIO;
+			break;
+		}
+	}
+
+	const auto released = filesystem.release(ino, &info);
+
+	return ret < 0 ? ret : released;
+}
+
+// Replaces the file's contents with size bytes from in, which are laid out
+// in one go first
+static int copyIn(Filesystem& filesystem, std::istream& in, off_t size, const char* name)
+{
+	struct stat st{};
+	struct fuse_file_info info{};
+
+	auto ret = filesystem.lookup(FUSE_ROOT_ID, name, &st);
+
+	if (ret == -ENOENT)
+		ret = filesystem.create(FUSE_ROOT_ID, name, S_IFREG | S_IRUSR | S_IWUSR, &st, &info);
+	else if (!ret)
+		ret = filesystem.open(st.st_ino, &info);
+
+	if (ret < 0)
+		return ret;
+
+	ret = filesystem.truncate(st.st_ino, 0);
+
+	if (!ret && size)
+		ret = filesystem.fallocate(st.st_ino, 0, 0, size, &info);
+
+	std::vector<char> buf(CHUNK_SIZE);
+
+	for (off_t offset = 0; !ret; offset += in.gcount()) {
+		if (!in.read(buf.data(), buf.size()) && !in.eof()) {
+			ret = -EIO;
+			break;
+		}
+
+		if (!in.gcount())
+			break;
+
+		const Filesystem::RequestScope scope;
+		const auto written = filesystem.write(st.st_ino, buf.data(), in.gcount(), offset, &info);
+
+		if (written < 0)
+			ret = written;
+		else if (written != in.gcount())
+			ret = -EIO;
+	}
+
+	const auto released = filesystem.release(st.st_ino, &info);
+
+	return ret < 0 ? ret : released;
+}
+
+// The names and sizes of the files, in directory order
+static int listing(Filesystem& filesystem, std::vector<std::pair<std::string, off_t>>& files)
+{
+	return filesystem.readdir(
+	    FUSE_ROOT_ID, &files,
+	    [](void* buf, const char* name, const struct stat* st, off_t, enum fuse_fill_dir_flags) {
+		    static_cast<std::remove_reference_t<decltype(files)>*>(buf)->emplace_back(name, st->st_size);
+		    return 0;
+	    },
+	    0, nullptr, static_cast<fuse_readdir_flags>(0));
+}
+
+static int list(Filesystem& filesystem, std::span<char*> /* args */)
+{
+	std::vector<std::pair<std::string, off_t>> files;
+
+	const auto ret = listing(filesystem, files);
+	if (ret < 0)
+		return fail("failed to read the directory", ret);
+
+	std::ranges::sort(files);
+
+	for (const auto& [name, size] : files)
+		std::cout << std::format("{:>8} {}\n", size, name);
+
+	return EXIT_SUCCESS;
+}
+
+static int cat(Filesystem& filesystem, std::span<char*> args)
+{
+	for (const auto name : args) {
+		struct stat st{};
+
+		auto ret = filesystem.lookup(FUSE_ROOT_ID, name, &st);
+
+		if (!ret)
+			ret = copyOut(filesystem, st.st_ino, std::cout);
+
+		if (ret < 0)
+			return fail(name, ret);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+static int get(Filesystem& filesystem, std::span<char*> args)
+{
+	const auto name = args[0];
+	const auto path = args.size() > 1 ? args[1] : name;
+
+	struct stat st{};
+
+	auto ret = filesystem.lookup(FUSE_ROOT_ID, name, &st);
+	if (ret < 0)
+		return fail(name, ret);
+
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+
+	if (!out) {
+		std::cerr << "Error: failed to create \"" << path << "\"\n";
+		return EXIT_FAILURE;
+	}
+
+	ret = copyOut(filesystem, st.st_ino, out);
+	if (ret < 0)
+		return fail(name, ret);
+
+	return EXIT_SUCCESS;
+}
+
+static int putFile(Filesystem& filesystem, const char* path, const std::string& name)
+{
+	std::ifstream in(path, std::ios::binary | std::ios::ate);
+
+	if (!in) {
+		std::cerr << "Error: failed to open \"" << path << "\"\n";
+		return EXIT_FAILURE;
+	}
+
+	const off_t size = in.tellg();
+
+	in.seekg(0);
+
+	const auto ret = copyIn(filesystem, in, size, name.c_str());
+	if (ret < 0)
+		return fail(name, ret);
+
+	return EXIT_SUCCESS;
+}
+
+static int put(Filesystem& filesystem, std::span<char*> args)
+{
+	const auto path = args[0];
+
+	return putFile(filesystem, path, args.size() > 1 ? std::string(args[1]) : fs::path(path).filename().string());
+}
+
+static int remove(Filesystem& filesystem, std::span<char*> args)
+{
+	auto ret = EXIT_SUCCESS;
+
+	for (const auto name : args) {
+		const auto err = filesystem.unlink(FUSE_ROOT_ID, name);
+
+		if (err < 0)
+			ret = fail(name, err);
+	}
+
+	return ret;
+}
+
+// Runs a command on the filesystem of the disk image args start with, and
+// saves the image if that succeeded and changed it
+template <int (*run)(Filesystem& filesystem, std::span<char*> args)>
+static int onImage(const Options& options, std::span<char*> args)
+{
+	const auto image = args[0];
+	auto disk        = Disk::create(image);
+
+	if (!disk) {
+		std::cerr << "Error: failed to load the disk image \"" << image << "\"\n";
+		return EXIT_FAILURE;
+	}
+
+	int ret = EXIT_SUCCESS;
+
+	{
+		// the directory is written out when the filesystem goes away
+		const auto filesystem = Filesystem::create(options.filesystem_, disk.get());
+
+		if (!filesystem) {
+			std::cerr << "Error: unsupported filesystem \"" << options.filesystem_ << "\"\n";
+			return EXIT_FAILURE;
+		}
+
+		ret = run(*filesystem, args.subspan(1));
+	}
+
+	if (ret == EXIT_SUCCESS && disk->modified())
+		disk->save(image);
+
+	return ret;
+}
+
+// Writes the files of one image into dir, returns how many
+static unsigned int extractImage(std::string_view type, Disk* disk, const fs::path& dir)
+{
+	const auto filesystem = Filesystem::create(type, disk);
+
+	if (!filesystem)
+		throw std::runtime_error(std::format("unsupported filesystem \"{}\"", type));
+
+	std::vector<std::pair<std::string, off_t>> files;
+
+	auto ret = listing(*filesystem, files);
+	if (ret < 0)
+		throw std::runtime_error(std::format("failed to read the directory: {}", std::strerror(-ret)));
+
+	fs::create_directories(dir);
+
+	for (const auto& [name, size] : files) {
+		// names are only checked for not being a path
+		if (name.empty() || name == "." || name == ".." || name.contains('/'))
+			throw std::runtime_error(std::format("unusable file name \"{}\"", name));
+
+		struct stat st{};
+
+		ret = filesystem->lookup(FUSE_ROOT_ID, name.c_str(), &st);
+
+		std::ofstream out(dir / name, std::ios::binary | std::ios::trunc);
+
+		if (!out)
+			throw std::runtime_error(std::format("failed to create {}", (dir / name).string()));
+
+		if (!ret)
+			ret = copyOut(*filesystem, st.st_ino, out);
+
+		if (ret < 0)
+			throw std::runtime_error(std::format("{}: {}", name, std::strerror(-ret)));
+	}
+
+	return files.size();
+}
+
+static int extractAll(const Options& options, std::span<char*> args)
+{
+	const fs::path root(args[0]);
+	const fs::path target(args[1]);
+	const auto tree = fs::is_directory(root);
+
+	// a single image lands in a directory named after it
+	std::vector<std::pair<fs::path, uintmax_t>> images;
+
+	if (tree) {
+		for (const auto& entry : fs::recursive_directory_iterator(root)) {
+			if (entry.is_regular_file())
+				images.emplace_back(fs::relative(entry.path(), root), entry.file_size());
+		}
+	} else
+		images.emplace_back(root.filename(), fs::file_size(root));
+
+	// the largest first, the small ones fill the gaps at the end
+	std::ranges::sort(images, std::ranges::greater(), &decltype(images)::value_type::second);
+
+	std::atomic<unsigned int> extracted{};
+	std::atomic<unsigned int> files{};
+	std::atomic<unsigned int> failed{};
+
+	WorkPool pool;
+
+	for (const auto& [image, size] : images) {
+		pool.add([&, image = tree ? root / image : root, dir = target / image] {
+			try {
+				// probing reads only the header, what is not an image is skipped
+				const auto disk = Disk::create(image);
+
+				if (!disk)
+					return;
+
+				files += extractImage(options.filesystem_, disk.get(), dir);
+				extracted++;
+			} catch (const std::exception& e) {
+				std::cerr << std::format("Error: {}: {}\n", image.string(), e.what());
+				failed++;
+			}
+		});
+	}
+
+	pool.run();
+
+	std::cout << std::format("{} files from {} images\n", files.load(), extracted.load());
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Builds a new image holding the files, which is only written once they
+// all made it in
+static int pack(const Options& options, std::span<char*> args)
+{
+	const auto image    = args[0];
+	const auto __layout = geometry(options);
+
+	if (!__layout) {
+		std::cerr << "Error: no geometry for the filesystem \"" << options.filesystem_ << "\"\n";
+		return EXIT_FAILURE;
+	}
+
+	std::vector<uintmax_t> sizes;
+
+	for (const auto path : args.subspan(1)) {
+		std::error_code ec;
+
+		sizes.push_back(fs::file_size(path, ec));
+
+		if (ec) {
+			std::cerr << "Error: " << path << ": " << ec.message() << "\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	const auto disk = Disk::create(image, DiskProperties(__layout->tracks_, __layout->heads_, __layout->sectors_, __layout->sectorSize_));
+
+	{
+		const auto filesystem = Filesystem::create(__layout->filesystem_, disk.get());
+
+		// the disk is empty, each file gets laid out in one run right after
+		// the previous one, so they fit if the blocks and entries suffice
+		struct statvfs st{};
+
+		auto ret = filesystem->statfs(FUSE_ROOT_ID, &st);
+		if (ret < 0)
+			return fail(image, ret);
+
+		const auto blocksPerEntry = filesystem->blocksPerEntry();
+
+		uintmax_t blocks  = 0;
+		uintmax_t entries = 0;
+
+		for (const auto size : sizes) {
+			const auto n = (size + st.f_bsize - 1) / st.f_bsize;
+
+			blocks += n;
+			entries += std::max<uintmax_t>((n + blocksPerEntry - 1) / blocksPerEntry, 1);
+		}
+
+		if (blocks > st.f_bfree || entries > st.f_ffree) {
+			std::cerr << std::format("Error: the files need {} blocks and {} directory entries, the disk has {} and {}\n", blocks, entries,
+			                         st.f_bfree, st.f_ffree);
+			return EXIT_FAILURE;
+		}
+
+		for (const auto path : args.subspan(1)) {
+			const auto name = fs::path(path).filename().string();
+
+			struct stat buf{};
+
+			// rather than replacing the one put there first
+			if (!filesystem->lookup(FUSE_ROOT_ID, name.c_str(), &buf)) {
+				std::cerr << "Error: \"" << name << "\" is given more than once\n";
+				return EXIT_FAILURE;
+			}
+
+			ret = putFile(*filesystem, path, name);
+			if (ret != EXIT_SUCCESS)
+				return ret;
+		}
+	}
+
+	disk->save(image);
+
+	return EXIT_SUCCESS;
+}
+
+// Writes blank images. Each kind of image is laid out and saved once, the
+// rest are copies of that.
+static int format(const Options& options, std::span<char*> args)
+{
+	const auto __layout = geometry(options);
+
+	if (!__layout) {
+		std::cerr << "Error: no geometry for the filesystem \"" << options.filesystem_ << "\"\n";
+		return EXIT_FAILURE;
+	}
+
+	const DiskProperties properties(__layout->tracks_, __layout->heads_, __layout->sectors_, __layout->sectorSize_);
+
+	// by extension, which picks the backend
+	std::map<fs::path, std::string> templates;
+
+	for (const auto path : args) {
+		const auto extension = fs::path(path).extension();
+		auto it              = templates.find(extension);
+
+		if (it == templates.end()) {
+			const auto disk = Disk::create(path, properties);
+
+			// throws unless the filesystem takes the layout
+			Filesystem::create(__layout->filesystem_, disk.get());
+
+			std::ostringstream out;
+
+			disk->save(out);
+
+			it = templates.emplace(extension, std::move(out).str()).first;
+		}
+
+		std::ofstream of(path, std::ios::binary | std::ios::trunc);
+
+		if (!of.write(it->second.data(), static_cast<std::streamsize>(it->second.size()))) {
+			std::cerr << "Error: failed to write \"" << path << "\"\n";
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+struct Command {
+	std::string_view name_;
+	std::string_view args_;
+	std::string_view help_;
+	size_t minArgs_{};
+	size_t maxArgs_{};
+	int (*run_)(const Options& options, std::span<char*> args){};
+};
+
+static constexpr auto ANY = std::numeric_limits<size_t>::max();
+
+// clang-format off
+static constexpr auto commands = std::to_array<Command>({
+	{"ls"         , "<disk-image>"                      , "List the files along with their sizes"    , 1, 1  , onImage<list>  },
+	{"cat"        , "<disk-image> <name>..."            , "Write files to the standard output"       , 2, ANY, onImage<cat>   },
+	{"get"        , "<disk-image> <name> [<host-file>]" , "Copy a file out of the image"             , 2, 3  , onImage<get>   },
+	{"put"        , "<disk-image> <host-file> [<name>]" , "Copy a file into the image, replacing it" , 2, 3  , onImage<put>   },
+	{"rm"         , "<disk-image> <name>..."            , "Delete files"                             , 2, ANY, onImage<remove>},
+	{"extract-all", "<image-dir> <host-dir>"            , "Copy out the files of all images found"   , 2, 2  , extractAll     },
+	{"pack"       , "<disk-image> <host-file>..."       , "Make a new image holding the files"       , 2, ANY, pack           },
+	{"format"     , "<disk-image>..."                   , "Make new blank images"                    , 1, ANY, format         },
+});
+// clang-format on
+
+bool Commands::known(std::string_view name)
+{
+	return std::ranges::find(commands, name, &Command::name_) != commands.end();
+}
+
+int Commands::run(std::span<char*> args)
+{
+	// clang-format off
+	static constexpr auto optionSpec = std::to_array<std::pair<std::string_view, std::string_view Options::*>>({
+		{"--filesystem=", &Options::filesystem_},
+		{"--geometry="  , &Options::geometry_  },
+	});
+	// clang-format on
+
+	const auto& command = *std::ranges::find(commands, std::string_view(args[1]), &Command::name_);
+
+	Options options;
+	std::vector<char*> operands;
+
+	for (const auto arg : args.subspan(2)) {
+		const std::string_view __arg(arg);
+		const auto option = std::ranges::find_if(optionSpec, [&__arg](const auto& spec) {
+			return __arg.starts_with(spec.first);
+		});
+
+		if (option != optionSpec.end())
+			options.*option->second = __arg.substr(option->first.size());
+		else
+			operands.push_back(arg);
+	}
+
+	if (operands.size() < command.minArgs_ || operands.size() > command.maxArgs_) {
+		std::cerr << "Usage: " << args[0] << " " << command.name_ << " [--filesystem=<fs>] [--geometry=<name>] " << command.args_ << "\n";
+		return EXIT_FAILURE;
+	}
+
+	// a geometry implies its filesystem
+	if (!options.geometry_.empty()) {
+		const auto __geometry = geometry(options);
+
+		if (!__geometry) {
+			std::cerr << "Error: unsupported geometry \"" << options.geometry_ << "\"\n";
+			return EXIT_FAILURE;
+		}
+
+		if (!options.filesystem_.empty() && options.filesystem_ != __geometry->filesystem_) {
+			std::cerr << "Error: the geometry \"" << options.geometry_ << "\" is for the filesystem \"" << __geometry->filesystem_ << "\"\n";
+			return EXIT_FAILURE;
+		}
+
+		options.filesystem_ = __geometry->filesystem_;
+	}
+
+	if (options.filesystem_.empty())
+		options.filesystem_ = "hc";
+
+	try {
+		return command.run_(options, operands);
+	} catch (const std::exception& e) {
+		std::cerr << "Error: " << e.what() << "\n";
+	}
+
+	return EXIT_FAILURE;
+}
+
+void Commands::help(const char* progname)
+{
+	std::cout << "Usage: " << progname << " <command> [--filesystem=<fs>] [--geometry=<name>] <args>\n";
+
+	for (const auto& command : commands)
+		std::cout << std::format("    {:<46} {}\n", std::format("{} {}", command.name_, command.args_), command.help_);
+
+	std::cout << "Geometries of new images:\n";
+
+	for (const auto& geometry : geometries) {
+		std::cout << std::format("    {:<46} {} tracks, {} sides, {} sectors of {} bytes ({})\n", geometry.name_, geometry.tracks_, geometry.heads_,
+		                         geometry.sectors_, geometry.sectorSize_, geometry.filesystem_);
+	}
+
+	std::cout << "\n";
+}
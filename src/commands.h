@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-2.0
+#pragma once
+
+#include <span>
+#include <string_view>
+
+// Work on a disk image in-process, without mounting it:
+//
+//   fuse-spectrum <command> [--filesystem=<fs>] <disk-image> [<args>]
+//
+// The filesystem is driven directly and the image is saved through its
+// backend when the command changed it.
+class Commands {
+public:
+	// Whether name is a command rather than a mount option
+	static bool known(std::string_view name);
+
+	// args are those of main(), with the command as the first argument
+	static int run(std::span<char*> args);
+
+	static void help(const char* progname);
+};
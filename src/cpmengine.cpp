@@ -0,0 +1,1595 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <shared_mutex>
+
+#include "cpmengine.h"
+#include "cpmfs.h"
+#include "hcfs.h"
+#include "log.h"
+
+template <typename Format>
+std::expected<unsigned int, int> CPMEngine<Format>::ipos(unsigned int pos) const
+{
+	if (pos > disk_->properties().maxPos())
+		return std::unexpected(-EIO);
+
+	// Only the sector within the track moves, so the track and head need not
+	// be taken apart, nor checked again
+	const auto sector = pos % disk_->properties().sectors();
+
+	return pos - sector + interleave_[sector];
+}
+
+template <typename Format>
+std::expected<void, int> CPMEngine<Format>::readBlock(unsigned int block, std::vector<unsigned char>& buf) const
+{
+	buf.clear();
+	buf.reserve(CPM_BLOCK_SIZE);
+
+	const auto start = (firstBlock_ + block) * CPM_BLOCK_SIZE / disk_->properties().sectorSize();
+	for (unsigned int i = start; i < (start + CPM_BLOCK_SIZE / disk_->properties().sectorSize()); i++) {
+		const auto pos = ipos(i);
+		if (!pos)
+			return std::unexpected(pos.error());
+
+		auto& sector = disk_->read(pos.value());
+
+		if (sector.data().empty())
+			buf.insert(buf.end(), disk_->properties().sectorSize(), 0);
+		else
+			std::copy(sector.data().begin(), sector.data().end(), std::back_inserter(buf));
+	}
+
+	return {};
+}
+
+template <typename Format>
+std::expected<void, int> CPMEngine<Format>::writeBlock(unsigned int block, std::span<const unsigned char> buf) const
+{
+	const auto sectorSize = disk_->properties().sectorSize();
+	const auto start      = (firstBlock_ + block) * CPM_BLOCK_SIZE / sectorSize;
+
+	// Straight into the sectors, which only get allocated the first time
+	for (size_t done = 0; done < buf.size(); done += sectorSize) {
+		const auto pos = ipos(start + done / sectorSize);
+		if (!pos)
+			return std::unexpected(pos.error());
+
+		const auto data = disk_->modify(pos.value());
+		if (!data)
+			return std::unexpected(data.error());
+
+		const auto n = std::min<size_t>(sectorSize, buf.size() - done);
+
+		std::copy_n(buf.begin() + done, n, data->begin());
+	}
+
+	return {};
+}
+
+template <typename Format>
+void CPMEngine<Format>::loadFAT()
+{
+	auto dir = std::make_shared<Directory>();
+	dir->reserve(CPM_DIRECTORY_ENTRIES);
+
+	savedFAT_.clear();
+
+	std::vector<unsigned char> buf;
+
+	for (unsigned int block = 0; block < CPM_DIRECTORY_BLOCKS; block++) {
+		if (!readBlock(block, buf))
+			throw std::runtime_error(std::format("failed to read directory block #{}", block + 1));
+
+		savedFAT_.insert(savedFAT_.end(), buf.begin(), buf.end());
+	}
+
+	for (unsigned int i = 0; i < std::min<size_t>(CPM_DIRECTORY_ENTRIES, savedFAT_.size() / sizeof(FATEntry)); i++)
+		dir->push_back(reinterpret_cast<const FATEntry*>(savedFAT_.data())[i]);
+
+	dir->blockMap_.assign(std::min<size_t>(dpb_.dsm_ + 1, disk_->properties().size() / CPM_BLOCK_SIZE - firstBlock_), true);
+
+	for (unsigned int block = 0; block < CPM_DIRECTORY_BLOCKS; block++)
+		dir->blockMap_.at(block) = false;
+
+	dir->freed_.assign(dir->blockMap_.size(), false);
+
+	dir->freeBlocks_  = dir->blockMap_.size() - CPM_DIRECTORY_BLOCKS;
+	dir->freeEntries_ = dir->size();
+
+	dir->names_.resize(dir->size());
+	dir->generations_.assign(dir->size(), 0);
+
+	for (const auto& entry : *dir)
+		dir->account(entry);
+
+	unwritten_.assign(dir->blockMap_.size(), false);
+
+	fatEntries_.store(dir);
+}
+
+template <typename Format>
+std::expected<void, int> CPMEngine<Format>::saveFAT()
+{
+	// No shortcut on disk_->modified(): deleting or renaming files only
+	// changes the directory in memory until now, so a session doing nothing
+	// else would be lost. Comparing against savedFAT_ writes only the blocks
+	// that changed instead.
+	const auto dir = fatEntries_.load();
+
+	// wipe the blocks files got but never wrote to, and the ones freed
+	// during this session
+	{
+		std::lock_guard<std::mutex> lock(unwrittenMutex_);
+
+		for (unsigned int block = 0; block < unwritten_.size(); block++) {
+			if (dir->blockMap_[block] ? dir->freed_[block] : unwritten_[block]) {
+				static const std::vector<unsigned char> buf(CPM_BLOCK_SIZE, CPM_FREE_BYTE);
+
+				const auto ret = writeBlock(block, buf);
+				if (!ret)
+					return ret;
+			}
+		}
+	}
+
+	// write back all FAT entries
+	std::vector<unsigned char> buf;
+
+	buf.reserve(savedFAT_.size());
+
+	for (const auto& entry : *dir)
+		buf.insert(buf.end(), reinterpret_cast<const unsigned char*>(&entry), reinterpret_cast<const unsigned char*>(&entry) + sizeof(entry));
+
+	// the directory blocks past the last entry stay as they are
+	if (savedFAT_.size() > buf.size())
+		buf.insert(buf.end(), savedFAT_.begin() + buf.size(), savedFAT_.end());
+
+	for (unsigned int i = 0; i < (buf.size() / CPM_BLOCK_SIZE); i++) {
+		const auto begin = buf.begin() + i * CPM_BLOCK_SIZE;
+		const auto end   = begin + CPM_BLOCK_SIZE;
+
+		// only the directory blocks that changed
+		if (savedFAT_.size() >= (i + 1) * CPM_BLOCK_SIZE && std::equal(begin, end, savedFAT_.begin() + i * CPM_BLOCK_SIZE))
+			continue;
+
+		const auto ret = writeBlock(i, {begin, end});
+		if (!ret)
+			return ret;
+	}
+
+	savedFAT_ = std::move(buf);
+
+	return {};
+}
+
+template <typename Format>
+std::optional<unsigned int> CPMEngine<Format>::find(const Directory& dir, const std::string& name) const
+{
+	return dir.names_.find(name);
+}
+
+template <typename Format>
+std::optional<unsigned int> CPMEngine<Format>::find(const Directory& dir, fuse_ino_t ino) const
+{
+	if (ino < CPM_FIRST_INODE || ino - CPM_FIRST_INODE >= dir.size())
+		return {};
+
+	const unsigned int slot = ino - CPM_FIRST_INODE;
+	const auto& entry       = dir[slot];
+
+	if (entry.free() || entry.extent())
+		return {};
+
+	return slot;
+}
+
+template <typename Format>
+std::pmr::vector<unsigned int> CPMEngine<Format>::extents(const Directory& dir, unsigned int slot) const
+{
+	std::pmr::vector<unsigned int> ret(arena());
+
+	const auto& file = dir[slot];
+
+	for (unsigned int i = 0; i < dir.size(); i++) {
+		if (!dir[i].free() && dir[i].sameFile(file))
+			ret.push_back(i);
+	}
+
+	std::sort(ret.begin(), ret.end(), [&dir](const auto& a, const auto& b) {
+		return dir[a].number() < dir[b].number();
+	});
+
+	return ret;
+}
+
+template <typename Format>
+unsigned int CPMEngine<Format>::fileSize(const Directory& dir, unsigned int slot) const
+{
+	unsigned int size = 0;
+
+	for (const auto i : extents(dir, slot))
+		size += dir[i].size();
+
+	return size;
+}
+
+template <typename Format>
+unsigned int CPMEngine<Format>::blockList(const Directory& dir, unsigned int slot, std::pmr::vector<unsigned short>& blocks) const
+{
+	unsigned int size = 0;
+
+	blocks.clear();
+
+	for (const auto i : extents(dir, slot)) {
+		size += dir[i].size();
+
+		for (const auto au : dir[i].allocationUnits_) {
+			if (au)
+				blocks.push_back(au);
+		}
+	}
+
+	return size;
+}
+
+template <typename Format>
+unsigned int CPMEngine<Format>::exactSize(unsigned int slot, unsigned int size) const
+{
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+
+		const auto it = pending_.find(slot);
+
+		if (it != pending_.end())
+			return it->second.length_;
+	}
+
+	std::lock_guard<std::mutex> lock(exactSizesMutex_);
+
+	const auto it = exactSizes_.find(slot);
+
+	// Only valid as long as the file still has the records it implies
+	if (it != exactSizes_.end() && (it->second + CPM_RECORD_SIZE - 1) / CPM_RECORD_SIZE * CPM_RECORD_SIZE == size)
+		return it->second;
+
+	return size;
+}
+
+template <typename Format>
+void CPMEngine<Format>::setExactSize(unsigned int slot, unsigned int size)
+{
+	std::lock_guard<std::mutex> lock(exactSizesMutex_);
+
+	exactSizes_[slot] = size;
+}
+
+template <typename Format>
+void CPMEngine<Format>::dropExactSize(unsigned int slot)
+{
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+
+		pending_.erase(slot);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(stagedMutex_);
+
+		staged_.erase(slot);
+	}
+
+	std::lock_guard<std::mutex> lock(exactSizesMutex_);
+
+	exactSizes_.erase(slot);
+}
+
+template <typename Format>
+std::pair<unsigned int, unsigned int> CPMEngine<Format>::reserved(std::optional<unsigned int> except) const
+{
+	std::pair<unsigned int, unsigned int> ret;
+
+	for (const auto& [slot, pending] : pending_) {
+		if (slot == except)
+			continue;
+
+		ret.first += pending.blocks_;
+		ret.second += pending.entries_;
+	}
+
+	return ret;
+}
+
+template <typename Format>
+int CPMEngine<Format>::commit(unsigned int slot)
+{
+	Pending* pending    = nullptr;
+	unsigned int length = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+
+		const auto it = pending_.find(slot);
+
+		if (it == pending_.end())
+			return 0;
+
+		pending = &it->second;
+		length  = pending->length_;
+	}
+
+	std::pmr::vector<unsigned short> blocks(arena());
+	std::pair<unsigned int, unsigned int> reservation;
+	std::string name;
+
+	{
+		std::unique_lock<std::shared_mutex> dirLock(dirMutex_);
+
+		auto dir = std::make_shared<Directory>(*fatEntries_.load());
+
+		const auto ret = resize(*dir, slot, length, false);
+		if (ret < 0)
+			return ret;
+
+		blockList(*dir, slot, blocks);
+
+		name = (*dir)[slot].name();
+
+		fatEntries_.store(dir);
+
+		// the file has its blocks now
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+
+		reservation = {pending->blocks_, pending->entries_};
+
+		pending->blocks_  = 0;
+		pending->entries_ = 0;
+	}
+
+	const auto held = pending->data_.size();
+
+	// Gives the blocks back and holds the data as before, so that the file
+	// stays as it was on the disk and to getattr()
+	const auto restore = [&](int error) {
+		pending->data_.resize(held);
+
+		std::unique_lock<std::shared_mutex> dirLock(dirMutex_);
+
+		auto dir = std::make_shared<Directory>(*fatEntries_.load());
+
+		if (!resize(*dir, slot, pending->start_))
+			fatEntries_.store(dir);
+
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+
+		std::tie(pending->blocks_, pending->entries_) = reservation;
+
+		return error;
+	};
+
+	// Pad to the end of the last block, so that each new block gets written
+	// exactly once
+	pending->data_.resize((length + CPM_BLOCK_SIZE - 1) / CPM_BLOCK_SIZE * CPM_BLOCK_SIZE - pending->start_, CPM_FREE_BYTE);
+
+	auto bufv = sectorBuffers(blocks, pending->start_, pending->data_.size(), true);
+	if (!bufv)
+		return restore(bufv.error());
+
+	auto src = FUSE_BUFVEC_INIT(pending->data_.size());
+
+	src.buf[0].mem = pending->data_.data();
+
+	const auto done = fuse_buf_copy(reinterpret_cast<struct fuse_bufvec*>(bufv->data()), &src, static_cast<fuse_buf_copy_flags>(0));
+	if (done < 0)
+		return restore(static_cast<int>(done));
+
+	setExactSize(slot, length);
+
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+
+		pending_.erase(slot);
+	}
+
+	// getattr() reported the size on the disk until now
+	invalidate(inode(slot), name, false);
+
+	return 0;
+}
+
+template <typename Format>
+std::expected<std::pmr::vector<struct fuse_buf>, int> CPMEngine<Format>::sectorBuffers(const std::pmr::vector<unsigned short>& blocks, off_t offset,
+                                                                                     size_t size, bool modify)
+{
+	const auto sectorSize      = disk_->properties().sectorSize();
+	const auto sectorsPerBlock = CPM_BLOCK_SIZE / sectorSize;
+	const size_t first         = offset / sectorSize;
+	const size_t last          = size ? (offset + size - 1) / sectorSize + 1 : first;
+
+	// a corrupt directory can have more records than blocks, or blocks
+	// past the end of the disk
+	if (last > first) {
+		if ((last - 1) / sectorsPerBlock >= blocks.size())
+			return std::unexpected(-EIO);
+
+		for (auto i = first / sectorsPerBlock; i <= (last - 1) / sectorsPerBlock; i++) {
+			if (blocks[i] >= unwritten_.size())
+				return std::unexpected(-EIO);
+		}
+	}
+
+	// fuse_bufvec ends with a one element array, sized here for all sectors.
+	// It is counted in fuse_buf for the alignment, the arena has no other.
+	const auto bytes = sizeof(struct fuse_bufvec) + (last - first) * sizeof(struct fuse_buf);
+
+	std::pmr::vector<struct fuse_buf> ret((bytes + sizeof(struct fuse_buf) - 1) / sizeof(struct fuse_buf), arena());
+	auto bufv = reinterpret_cast<struct fuse_bufvec*>(ret.data());
+
+	bufv->count = last - first;
+	bufv->idx   = 0;
+	bufv->off   = offset % sectorSize;
+
+	static const std::vector<unsigned char> fill(CPM_BLOCK_SIZE, CPM_FREE_BYTE);
+
+	// by block index within the range
+	std::pmr::vector<bool> unwritten(arena());
+
+	{
+		std::lock_guard<std::mutex> lock(unwrittenMutex_);
+
+		for (auto i = first / sectorsPerBlock; last > first && i <= (last - 1) / sectorsPerBlock; i++)
+			unwritten.push_back(unwritten_[blocks[i]]);
+	}
+
+	// wipe the blocks about to be written to for the first time
+	for (unsigned int i = 0; modify && i < unwritten.size(); i++) {
+		const auto block = blocks[first / sectorsPerBlock + i];
+
+		if (unwritten[i]) {
+			const auto ret = writeBlock(block, fill);
+			if (!ret)
+				return std::unexpected(ret.error());
+
+			std::lock_guard<std::mutex> lock(unwrittenMutex_);
+
+			unwritten_[block] = false;
+			unwritten[i]      = false;
+		}
+	}
+
+	for (auto i = first; i < last; i++) {
+		const auto block = blocks[i / sectorsPerBlock];
+		const auto pos   = ipos((firstBlock_ + block) * sectorsPerBlock + i % sectorsPerBlock);
+		auto& buf        = bufv->buf[i - first];
+
+		if (!pos)
+			return std::unexpected(pos.error());
+
+		buf      = {};
+		buf.size = sectorSize;
+		buf.fd   = -1;
+
+		if (modify) {
+			const auto data = disk_->modify(pos.value());
+			if (!data)
+				return std::unexpected(data.error());
+
+			buf.mem = data->data();
+		} else if (unwritten[i / sectorsPerBlock - first / sectorsPerBlock])
+			buf.mem = const_cast<unsigned char*>(fill.data());
+		else {
+			// sectors never written read as zeros, as in readBlock()
+			static const std::vector<unsigned char> zeros(CPM_BLOCK_SIZE, 0);
+			const auto& data = disk_->read(pos.value()).data();
+
+			buf.mem = const_cast<unsigned char*>(data.empty() ? zeros.data() : data.data());
+		}
+	}
+
+	// trim the last sector to the end of the range
+	if (last > first)
+		bufv->buf[last - first - 1].size -= last * sectorSize - (offset + size);
+
+	return ret;
+}
+
+template <typename Format>
+typename CPMEngine<Format>::Staged* CPMEngine<Format>::staging(unsigned int slot)
+{
+	if (!staging_)
+		return nullptr;
+
+	std::lock_guard<std::mutex> lock(stagedMutex_);
+
+	const auto it = staged_.find(slot);
+
+	return it != staged_.end() ? &it->second : nullptr;
+}
+
+template <typename Format>
+int CPMEngine<Format>::stage(const Directory& dir, unsigned int slot, Staged& staged)
+{
+	std::pmr::vector<unsigned short> blocks(arena());
+
+	const auto records = blockList(dir, slot, blocks);
+
+	staged.size_ = exactSize(slot, records);
+	staged.data_.assign(records, 0);
+	staged.dirty_.assign(blocks.size(), false);
+
+	auto bufv = sectorBuffers(blocks, 0, records, false);
+	if (!bufv)
+		return bufv.error();
+
+	auto dst = FUSE_BUFVEC_INIT(staged.data_.size());
+
+	dst.buf[0].mem = staged.data_.data();
+
+	const auto done = fuse_buf_copy(&dst, reinterpret_cast<struct fuse_bufvec*>(bufv->data()), static_cast<fuse_buf_copy_flags>(0));
+	if (done < 0)
+		return static_cast<int>(done);
+
+	const Pending* pending = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+
+		const auto it = pending_.find(slot);
+
+		if (it != pending_.end())
+			pending = &it->second;
+	}
+
+	if (pending)
+		staged.data_.insert(staged.data_.end(), pending->data_.begin(), pending->data_.end());
+
+	return 0;
+}
+
+template <typename Format>
+int CPMEngine<Format>::writeBack(unsigned int slot, Staged& staged)
+{
+	std::pmr::vector<unsigned short> blocks(arena());
+	std::pmr::vector<unsigned char> buf(arena());
+
+	blockList(*fatEntries_.load(), slot, blocks);
+
+	for (unsigned int i = 0; i < std::min(staged.dirty_.size(), blocks.size()); i++) {
+		if (!staged.dirty_[i])
+			continue;
+
+		const auto from = std::min<size_t>(i * CPM_BLOCK_SIZE, staged.data_.size());
+		const auto to   = std::min<size_t>(from + CPM_BLOCK_SIZE, staged.data_.size());
+
+		buf.assign(staged.data_.begin() + from, staged.data_.begin() + to);
+		buf.resize(CPM_BLOCK_SIZE, CPM_FREE_BYTE);
+
+		const auto ret = writeBlock(blocks[i], buf);
+		if (!ret)
+			return ret.error();
+
+		{
+			std::lock_guard<std::mutex> lock(unwrittenMutex_);
+
+			if (blocks[i] < unwritten_.size())
+				unwritten_[blocks[i]] = false;
+		}
+
+		staged.dirty_[i] = false;
+	}
+
+	return 0;
+}
+
+template <typename Format>
+void CPMEngine<Format>::fillStat(const Directory& dir, unsigned int slot, struct stat* buf) const
+{
+	std::memset(buf, 0, sizeof(*buf));
+	buf->st_ino     = inode(slot);
+	buf->st_mode    = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+	buf->st_nlink   = 1;
+	buf->st_size    = exactSize(slot, fileSize(dir, slot));
+	buf->st_blksize = disk_->properties().sectorSize();
+	buf->st_blocks  = buf->st_size / 512 + (buf->st_size % 512 ? 1 : 0);
+}
+
+template <typename Format>
+CPMEngine<Format>::CPMEngine(Disk* disk, bool staging)
+    : disk_{disk}
+    , interleave_{Format::interleave(disk->properties().sectors())}
+    , firstBlock_{dpb_.off_ * disk->properties().sectorsPerTrack() * disk->properties().sectorSize() / CPM_BLOCK_SIZE}
+    , staging_{staging}
+{
+	if (interleave_.empty())
+		throw std::runtime_error(
+		    std::format("no sector interleave available for the current number of sectors ({})", disk_->properties().sectors()));
+
+	loadFAT();
+}
+
+template <typename Format>
+CPMEngine<Format>::~CPMEngine()
+{
+	for (auto& [slot, staged] : staged_) {
+		if (writeBack(slot, staged) < 0)
+			std::cerr << "Error: failed to write file #" << slot << " back\n";
+	}
+
+	std::vector<unsigned int> slots;
+
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+
+		for (const auto& [slot, pending] : pending_)
+			slots.push_back(slot);
+	}
+
+	for (const auto slot : slots) {
+		if (commit(slot) < 0)
+			std::cerr << "Error: failed to write file #" << slot << " out\n";
+	}
+
+	if (!saveFAT())
+		std::cerr << "Error: failed to save the directory\n";
+}
+
+template <typename Format>
+int CPMEngine<Format>::lookup(fuse_ino_t parent, const char* name, struct stat* buf)
+{
+	if (parent != FUSE_ROOT_ID)
+		return -ENOENT;
+
+	const std::string __name(name);
+	unsigned long generation = 0;
+
+	if (missed(__name, generation))
+		return -ENOENT;
+
+	const auto dir  = fatEntries_.load();
+	const auto slot = find(*dir, __name);
+
+	if (!slot) {
+		rememberMiss(__name, generation);
+		return -ENOENT;
+	}
+
+	fillStat(*dir, slot.value(), buf);
+
+	return 0;
+}
+
+template <typename Format>
+int CPMEngine<Format>::getattr(fuse_ino_t ino, struct stat* buf)
+{
+	const auto dir = fatEntries_.load();
+
+	if (ino == FUSE_ROOT_ID) {
+		std::memset(buf, 0, sizeof(*buf));
+		buf->st_ino     = FUSE_ROOT_ID;
+		buf->st_mode    = S_IFDIR | S_IXUSR | S_IRUSR | S_IWUSR | S_IXGRP | S_IRGRP | S_IXOTH | S_IROTH;
+		buf->st_nlink   = 1;
+		buf->st_size    = dir->files_ * 2;
+		buf->st_blksize = disk_->properties().sectorSize();
+		buf->st_blocks  = CPM_BLOCK_SIZE * CPM_DIRECTORY_BLOCKS / 512;
+
+		return 0;
+	}
+
+	const auto slot = find(*dir, ino);
+
+	if (!slot)
+		return -ENOENT;
+
+	fillStat(*dir, slot.value(), buf);
+
+	return 0;
+}
+
+template <typename Format>
+uint64_t CPMEngine<Format>::generation(fuse_ino_t ino)
+{
+	const auto dir = fatEntries_.load();
+
+	if (ino < CPM_FIRST_INODE || ino - CPM_FIRST_INODE >= dir->size())
+		return 0;
+
+	return dir->generations_[ino - CPM_FIRST_INODE];
+}
+
+template <typename Format>
+int CPMEngine<Format>::unlink(fuse_ino_t parent, const char* name)
+{
+	if (parent != FUSE_ROOT_ID)
+		return -ENOENT;
+
+	for (;;) {
+		fuse_ino_t ino = 0;
+
+		{
+			const auto slot = find(*fatEntries_.load(), std::string(name));
+
+			if (!slot)
+				return -ENOENT;
+
+			ino = inode(slot.value());
+		}
+
+		// Let the I/O in flight on the file drain before freeing its blocks
+		std::unique_lock<std::shared_mutex> fileLock(fileMutex(ino));
+		std::unique_lock<std::shared_mutex> dirLock(dirMutex_);
+
+		auto dir        = std::make_shared<Directory>(*fatEntries_.load());
+		const auto slot = find(*dir, std::string(name));
+
+		if (!slot)
+			return -ENOENT;
+
+		// The name got recreated in another slot meanwhile
+		if (inode(slot.value()) != ino)
+			continue;
+
+		for (const auto i : extents(*dir, slot.value()))
+			dir->release((*dir)[i]);
+
+		fatEntries_.store(dir);
+
+		dropExactSize(slot.value());
+
+		invalidate(FUSE_ROOT_ID, "", false);
+
+		return 0;
+	}
+}
+
+template <typename Format>
+int CPMEngine<Format>::rename(fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname, unsigned int flags)
+{
+	if (parent != FUSE_ROOT_ID || newparent != FUSE_ROOT_ID)
+		return -ENOENT;
+
+	if (flags & ~RENAME_NOREPLACE)
+		return -EINVAL;
+
+	const std::string __name(name);
+	const std::string __newname(newname);
+
+	if (!FATEntry::storable(__newname))
+		return -ENAMETOOLONG;
+
+	for (;;) {
+		std::optional<fuse_ino_t> target;
+
+		{
+			const auto slot = find(*fatEntries_.load(), __newname);
+
+			if (slot)
+				target = inode(slot.value());
+		}
+
+		// A replaced file goes away as with unlink()
+		std::unique_lock<std::shared_mutex> fileLock;
+
+		if (target)
+			fileLock = std::unique_lock<std::shared_mutex>(fileMutex(target.value()));
+
+		std::unique_lock<std::shared_mutex> dirLock(dirMutex_);
+
+		auto dir        = std::make_shared<Directory>(*fatEntries_.load());
+		const auto slot = find(*dir, __name);
+
+		if (!slot)
+			return -ENOENT;
+
+		const auto existing = find(*dir, __newname);
+
+		// The target got created or removed meanwhile
+		if (existing.has_value() != target.has_value() || (existing && inode(existing.value()) != target.value()))
+			continue;
+
+		if (existing == slot)
+			return 0;
+
+		if (existing) {
+			if (flags & RENAME_NOREPLACE)
+				return -EEXIST;
+
+			for (const auto i : extents(*dir, existing.value()))
+				dir->release((*dir)[i]);
+
+			dropExactSize(existing.value());
+
+			// an open handle on the old target keeps its pages otherwise
+			invalidate(inode(existing.value()), __newname, true);
+		}
+
+		for (const auto i : extents(*dir, slot.value()))
+			dir->rename((*dir)[i], __newname);
+
+		fatEntries_.store(dir);
+
+		forgetMisses();
+		invalidate(FUSE_ROOT_ID, "", false);
+
+		return 0;
+	}
+}
+
+template <typename Format>
+int CPMEngine<Format>::truncate(fuse_ino_t ino, off_t length)
+{
+	std::unique_lock<std::shared_mutex> fileLock(fileMutex(ino));
+
+	{
+		const auto slot = find(*fatEntries_.load(), ino);
+
+		if (!slot)
+			return -ENOENT;
+
+		const auto staged = staging(slot.value());
+
+		auto ret = staged ? writeBack(slot.value(), *staged) : 0;
+		if (ret < 0)
+			return ret;
+
+		ret = commit(slot.value());
+		if (ret < 0)
+			return ret;
+	}
+
+	std::unique_lock<std::shared_mutex> dirLock(dirMutex_);
+
+	auto dir        = std::make_shared<Directory>(*fatEntries_.load());
+	const auto slot = find(*dir, ino);
+
+	if (!slot)
+		return -ENOENT;
+
+	const auto ret = resize(*dir, slot.value(), length);
+	if (ret < 0)
+		return ret;
+
+	fatEntries_.store(dir);
+
+	setExactSize(slot.value(), static_cast<unsigned int>(length));
+
+	if (const auto staged = staging(slot.value()))
+		return stage(*dir, slot.value(), *staged);
+
+	return 0;
+}
+
+template <typename Format>
+int CPMEngine<Format>::resize(Directory& dir, unsigned int slot, off_t length, bool wipe)
+{
+	// Work on a copy: the first extent itself gets modified below
+	const auto file = dir[slot];
+
+	std::pmr::vector<FATEntry*> entries(arena());
+
+	for (const auto i : extents(dir, slot))
+		entries.push_back(&dir[i]);
+
+	unsigned int size   = 0;
+	unsigned int blocks = 0;
+
+	for (const auto entry : entries) {
+		size += entry->size();
+		blocks += entry->blocks();
+	}
+
+	if (length == size)
+		return 0;
+
+	const unsigned int recordsPerEntry = CPM_MAX_ALLOCATION_UNITS * CPM_BLOCK_SIZE / CPM_RECORD_SIZE;
+	const unsigned int recordsNeeded   = length / CPM_RECORD_SIZE + (length % CPM_RECORD_SIZE ? 1 : 0);
+	const unsigned int blocksNeeded    = length / CPM_BLOCK_SIZE + (length % CPM_BLOCK_SIZE ? 1 : 0);
+
+	if (length < size) {
+		// Keep the blocks still needed, in extent order, and drop the rest
+		unsigned int block = 0;
+
+		for (auto entry : entries) {
+			for (auto& au : entry->allocationUnits_) {
+				if (au && block++ >= blocksNeeded) {
+					dir.freeBlock(au);
+					au = 0;
+				}
+			}
+		}
+	} else if (blocksNeeded > blocks) {
+		unsigned int n = blocksNeeded - blocks;
+
+		// Make sure the whole request can be satisfied before touching anything
+		unsigned int extentsNeeded = blocksNeeded / CPM_MAX_ALLOCATION_UNITS + (blocksNeeded % CPM_MAX_ALLOCATION_UNITS ? 1 : 0);
+		extentsNeeded              = std::max<unsigned int>(extentsNeeded, entries.size());
+
+		unsigned int reservedBlocks  = 0;
+		unsigned int reservedEntries = 0;
+
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex_);
+
+			std::tie(reservedBlocks, reservedEntries) = reserved(slot);
+		}
+
+		if (dir.freeBlocks_ < n + reservedBlocks || dir.freeEntries_ < extentsNeeded - entries.size() + reservedEntries)
+			return -ENOSPC;
+
+		unsigned short last = 0;
+
+		for (const auto entry : entries) {
+			for (const auto au : entry->allocationUnits_) {
+				if (au)
+					last = au;
+			}
+		}
+
+		const auto fresh = dir.allocateBlocks(n, last);
+		auto next        = fresh.begin();
+
+		auto it = dir.begin();
+
+		for (unsigned int i = 0; n > 0; i++) {
+			if (i == entries.size()) {
+				// Open a new extent in the next free directory entry
+				it = std::find_if(it, dir.end(), [](const auto& entry) {
+					return entry.free();
+				});
+
+				it->clear();
+				it->userCode_ = file.userCode_;
+				it->name_     = file.name_;
+				it->setRecords(i, 0);
+
+				dir.account(*it);
+
+				entries.push_back(&*it);
+			}
+
+			for (auto& au : entries[i]->allocationUnits_) {
+				if (au || !n)
+					continue;
+
+				au = *next++;
+
+				// the block's contents get wiped when first written to
+				{
+					std::lock_guard<std::mutex> lock(unwrittenMutex_);
+
+					unwritten_[au] = wipe;
+				}
+
+				n--;
+			}
+		}
+	}
+
+	// Spread the records over the extents, dropping the ones left empty
+	unsigned int records = 0;
+	unsigned int ordinal = 0;
+
+	for (auto entry : entries) {
+		const unsigned int recordCount = std::min(recordsPerEntry, recordsNeeded - records);
+
+		records += recordCount;
+
+		if (!recordCount && entry->extent())
+			dir.release(*entry);
+		else
+			entry->setRecords(ordinal, recordCount);
+
+		ordinal++;
+	}
+
+	return 0;
+}
+
+template <typename Format>
+int CPMEngine<Format>::open(fuse_ino_t ino, struct fuse_file_info* /* info */)
+{
+	if (!staging_) {
+		if (find(*fatEntries_.load(), ino))
+			return 0;
+
+		return -ENOENT;
+	}
+
+	std::unique_lock<std::shared_mutex> fileLock(fileMutex(ino));
+
+	const auto dir  = fatEntries_.load();
+	const auto slot = find(*dir, ino);
+
+	if (!slot)
+		return -ENOENT;
+
+	if (const auto staged = staging(slot.value())) {
+		staged->handles_++;
+		return 0;
+	}
+
+	Staged staged;
+
+	const auto ret = stage(*dir, slot.value(), staged);
+	if (ret < 0)
+		return ret;
+
+	staged.handles_ = 1;
+
+	std::lock_guard<std::mutex> lock(stagedMutex_);
+
+	staged_.insert_or_assign(slot.value(), std::move(staged));
+
+	return 0;
+}
+
+template <typename Format>
+int CPMEngine<Format>::readBuf(fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* /* info */,
+                               const std::function<int(struct fuse_bufvec*)>& reply)
+{
+	std::shared_lock<std::shared_mutex> fileLock(fileMutex(ino));
+	std::pmr::vector<unsigned short> blocks(arena());
+
+	// The file's extents cannot change while the file lock is held, so
+	// any snapshot taken from now on has its current block list
+	const auto dir  = fatEntries_.load();
+	const auto slot = find(*dir, ino);
+
+	if (!slot)
+		return -ENOENT;
+
+	// The whole file is at hand
+	if (const auto staged = staging(slot.value())) {
+		size = offset < staged->size_ ? std::min<size_t>(size, staged->size_ - offset) : 0;
+
+		auto bufv = FUSE_BUFVEC_INIT(size);
+
+		bufv.buf[0].mem = staged->data_.data() + std::min<size_t>(offset, staged->data_.size());
+
+		return reply(&bufv);
+	}
+
+	const auto records   = blockList(*dir, slot.value(), blocks);
+	const auto totalSize = exactSize(slot.value(), records);
+
+	if (offset >= totalSize)
+		size = 0;
+	else
+		size = std::min<size_t>(size, totalSize - offset);
+
+	const size_t inPlace = offset < records ? std::min<size_t>(size, records - offset) : 0;
+
+	auto bufv = sectorBuffers(blocks, offset, inPlace, false);
+	if (!bufv)
+		return bufv.error();
+
+	// The rest still waits for its blocks, the file lock keeps it in place
+	if (inPlace < size) {
+		const Pending* pending = nullptr;
+
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex_);
+
+			pending = &pending_.at(slot.value());
+		}
+
+		auto v = reinterpret_cast<struct fuse_bufvec*>(bufv->data());
+
+		if (!v->count)
+			v->off = 0;
+
+		auto& buf = v->buf[v->count++];
+
+		buf      = {};
+		buf.size = size - inPlace;
+		buf.mem  = const_cast<unsigned char*>(pending->data_.data() + (offset + inPlace - pending->start_));
+		buf.fd   = -1;
+	}
+
+	return reply(reinterpret_cast<struct fuse_bufvec*>(bufv->data()));
+}
+
+template <typename Format>
+int CPMEngine<Format>::writeBuf(fuse_ino_t ino, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* /* info */)
+{
+	std::unique_lock<std::shared_mutex> fileLock(fileMutex(ino));
+	std::pmr::vector<unsigned short> blocks(arena());
+
+	const auto size = fuse_buf_size(buf);
+	const auto dir  = fatEntries_.load();
+	const auto slot = find(*dir, ino);
+
+	if (!slot)
+		return -ENOENT;
+
+	const auto totalSize = blockList(*dir, slot.value(), blocks);
+	const auto fileSize  = exactSize(slot.value(), totalSize);
+	const auto end       = static_cast<off_t>(offset + size);
+	const auto staged    = staging(slot.value());
+	ssize_t done         = 0;
+
+	// Rewrite the records in place, or their staged copy
+	if (offset < totalSize && staged) {
+		staged->data_.resize(std::max<size_t>(staged->data_.size(), totalSize), CPM_FREE_BYTE);
+
+		auto dst = FUSE_BUFVEC_INIT(static_cast<size_t>(std::min<off_t>(end, totalSize) - offset));
+
+		dst.buf[0].mem = staged->data_.data() + offset;
+
+		done = fuse_buf_copy(&dst, buf, static_cast<fuse_buf_copy_flags>(0));
+		if (done < 0)
+			return static_cast<int>(done);
+
+		staged->dirty_.resize(std::max(staged->dirty_.size(), blocks.size()));
+
+		for (auto i = offset / CPM_BLOCK_SIZE; i < (offset + done + CPM_BLOCK_SIZE - 1) / CPM_BLOCK_SIZE; i++)
+			staged->dirty_[i] = true;
+	} else if (offset < totalSize) {
+		auto bufv = sectorBuffers(blocks, offset, std::min<off_t>(end, totalSize) - offset, true);
+		if (!bufv)
+			return bufv.error();
+
+		done = fuse_buf_copy(reinterpret_cast<struct fuse_bufvec*>(bufv->data()), buf, static_cast<fuse_buf_copy_flags>(0));
+		if (done < 0)
+			return static_cast<int>(done);
+	}
+
+	// Hold on to what goes past them, reserving the space it will need
+	if (end > totalSize) {
+		Pending* pending = nullptr;
+
+		{
+			std::shared_lock<std::shared_mutex> dirLock(dirMutex_);
+			std::lock_guard<std::mutex> lock(pendingMutex_);
+
+			const auto current = fatEntries_.load();
+			const auto fresh   = !pending_.contains(slot.value());
+
+			pending = &pending_[slot.value()];
+
+			if (fresh) {
+				pending->start_  = totalSize;
+				pending->length_ = totalSize;
+			}
+
+			const auto length               = std::max<size_t>(pending->length_, end);
+			const unsigned int blocksNeeded = length / CPM_BLOCK_SIZE + (length % CPM_BLOCK_SIZE ? 1 : 0);
+			const unsigned int extentCount  = extents(*current, slot.value()).size();
+
+			unsigned int extentsNeeded = blocksNeeded / CPM_MAX_ALLOCATION_UNITS + (blocksNeeded % CPM_MAX_ALLOCATION_UNITS ? 1 : 0);
+			extentsNeeded              = std::max(extentsNeeded, extentCount);
+
+			const unsigned int blocksMore  = blocksNeeded > blocks.size() ? blocksNeeded - blocks.size() : 0;
+			const unsigned int entriesMore = extentsNeeded - extentCount;
+
+			const auto [otherBlocks, otherEntries] = reserved(slot.value());
+
+			if (current->freeBlocks_ < otherBlocks + blocksMore || current->freeEntries_ < otherEntries + entriesMore) {
+				if (fresh)
+					pending_.erase(slot.value());
+
+				return done ? static_cast<int>(done) : -ENOSPC;
+			}
+
+			pending->blocks_  = blocksMore;
+			pending->entries_ = entriesMore;
+		}
+
+		pending->data_.resize(std::max<size_t>(pending->data_.size(), end - pending->start_), CPM_FREE_BYTE);
+
+		const auto from = offset + done;
+		auto dst        = FUSE_BUFVEC_INIT(static_cast<size_t>(end - from));
+
+		dst.buf[0].mem = pending->data_.data() + (from - pending->start_);
+
+		const auto held = fuse_buf_copy(&dst, buf, static_cast<fuse_buf_copy_flags>(0));
+		if (held < 0)
+			return static_cast<int>(held);
+
+		done += held;
+
+		{
+			std::lock_guard<std::mutex> lock(pendingMutex_);
+
+			pending->length_ = std::max<unsigned int>(pending->length_, offset + done);
+		}
+
+		// along with any gap the write left behind
+		if (staged) {
+			const auto first = std::max<off_t>(std::min<off_t>(from, staged->size_), pending->start_);
+
+			staged->data_.resize(std::max<size_t>(staged->data_.size(), offset + done), CPM_FREE_BYTE);
+
+			std::copy(pending->data_.begin() + (first - pending->start_), pending->data_.begin() + (offset + done - pending->start_),
+			          staged->data_.begin() + first);
+		}
+	}
+
+	if (offset + done > fileSize)
+		setExactSize(slot.value(), offset + done);
+
+	if (staged)
+		staged->size_ = std::max<unsigned int>(staged->size_, offset + done);
+
+	return static_cast<int>(done);
+}
+
+template <typename Format>
+ssize_t CPMEngine<Format>::copyFileRange(fuse_ino_t inoIn, off_t offsetIn, struct fuse_file_info* infoIn, fuse_ino_t inoOut, off_t offsetOut,
+                                         struct fuse_file_info* infoOut, size_t size)
+{
+	// Staged files are in memory already, and a range copied within one
+	// file may overlap itself
+	if (staging_ || inoIn == inoOut)
+		return Filesystem::copyFileRange(inoIn, offsetIn, infoIn, inoOut, offsetOut, infoOut, size);
+
+	// Both files are locked at once, the stripes in an order std::lock()
+	// settles on so that a copy going the other way cannot deadlock
+	auto& mutexIn  = fileMutex(inoIn);
+	auto& mutexOut = fileMutex(inoOut);
+
+	std::unique_lock<std::shared_mutex> lockIn(mutexIn, std::defer_lock);
+	std::unique_lock<std::shared_mutex> lockOut(mutexOut, std::defer_lock);
+
+	if (&mutexIn == &mutexOut)
+		lockIn.lock();
+	else
+		std::lock(lockIn, lockOut);
+
+	{
+		const auto dir = fatEntries_.load();
+		const auto in  = find(*dir, inoIn);
+		const auto out = find(*dir, inoOut);
+
+		if (!in || !out)
+			return -ENOENT;
+
+		// Either file's held data goes to its blocks first, so that the
+		// whole range is in sectors on both sides
+		auto ret = commit(in.value());
+		if (ret < 0)
+			return ret;
+
+		ret = commit(out.value());
+		if (ret < 0)
+			return ret;
+	}
+
+	std::pmr::vector<unsigned short> blocksIn(arena());
+	std::pmr::vector<unsigned short> blocksOut(arena());
+
+	unsigned int slotOut = 0;
+
+	{
+		std::unique_lock<std::shared_mutex> dirLock(dirMutex_);
+
+		std::shared_ptr<const Directory> dir = fatEntries_.load();
+		const auto in                        = find(*dir, inoIn);
+		const auto out                       = find(*dir, inoOut);
+		const auto sizeIn                    = exactSize(in.value(), blockList(*dir, in.value(), blocksIn));
+		const auto sizeOut = exactSize(out.value(), fileSize(*dir, out.value()));
+
+		slotOut = out.value();
+
+		if (offsetIn >= sizeIn)
+			return 0;
+
+		size = std::min<size_t>(size, sizeIn - offsetIn);
+
+		// The destination gets its blocks in one go, unwritten until copied to
+		if (offsetOut + size > sizeOut) {
+			auto grown = std::make_shared<Directory>(*dir);
+
+			const auto ret = resize(*grown, slotOut, offsetOut + size);
+			if (ret < 0)
+				return ret;
+
+			fatEntries_.store(grown);
+			dir = grown;
+
+			setExactSize(slotOut, static_cast<unsigned int>(offsetOut + size));
+		}
+
+		blockList(*dir, slotOut, blocksOut);
+	}
+
+	// Sector to sector, the unaligned head and tail included
+	auto src = sectorBuffers(blocksIn, offsetIn, size, false);
+	if (!src)
+		return src.error();
+
+	auto dst = sectorBuffers(blocksOut, offsetOut, size, true);
+	if (!dst)
+		return dst.error();
+
+	return fuse_buf_copy(reinterpret_cast<struct fuse_bufvec*>(dst->data()), reinterpret_cast<struct fuse_bufvec*>(src->data()),
+	                     static_cast<fuse_buf_copy_flags>(0));
+}
+
+template <typename Format>
+int CPMEngine<Format>::flush(fuse_ino_t ino, struct fuse_file_info* /* info */)
+{
+	// Wait for the writes still running on the file and give the data held
+	// its blocks; the data itself goes to the image file when unmounting
+	std::unique_lock<std::shared_mutex> lock(fileMutex(ino));
+
+	const auto slot = find(*fatEntries_.load(), ino);
+
+	if (!slot)
+		return -ENOENT;
+
+	if (const auto staged = staging(slot.value())) {
+		const auto ret = writeBack(slot.value(), *staged);
+		if (ret < 0)
+			return ret;
+	}
+
+	return commit(slot.value());
+}
+
+template <typename Format>
+int CPMEngine<Format>::fsync(fuse_ino_t ino, int /* datasync */, struct fuse_file_info* info)
+{
+	return flush(ino, info);
+}
+
+template <typename Format>
+int CPMEngine<Format>::fallocate(fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* /* info */)
+{
+	// Only plain preallocation, which extends the file as well
+	if (mode)
+		return -EOPNOTSUPP;
+
+	std::unique_lock<std::shared_mutex> fileLock(fileMutex(ino));
+
+	const auto slot = find(*fatEntries_.load(), ino);
+
+	if (!slot)
+		return -ENOENT;
+
+	const auto staged = staging(slot.value());
+
+	auto ret = staged ? writeBack(slot.value(), *staged) : 0;
+	if (ret < 0)
+		return ret;
+
+	ret = commit(slot.value());
+	if (ret < 0)
+		return ret;
+
+	std::unique_lock<std::shared_mutex> dirLock(dirMutex_);
+
+	auto dir = std::make_shared<Directory>(*fatEntries_.load());
+
+	if (offset + length <= exactSize(slot.value(), fileSize(*dir, slot.value())))
+		return 0;
+
+	// The blocks come as one run and stay unwritten until used
+	ret = resize(*dir, slot.value(), offset + length);
+	if (ret < 0)
+		return ret;
+
+	fatEntries_.store(dir);
+
+	setExactSize(slot.value(), static_cast<unsigned int>(offset + length));
+
+	if (staged)
+		return stage(*dir, slot.value(), *staged);
+
+	return 0;
+}
+
+template <typename Format>
+int CPMEngine<Format>::statfs(fuse_ino_t /* ino */, struct statvfs* buf)
+{
+	const auto dir = fatEntries_.load();
+
+	unsigned int reservedBlocks  = 0;
+	unsigned int reservedEntries = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(pendingMutex_);
+
+		std::tie(reservedBlocks, reservedEntries) = reserved({});
+	}
+
+	const unsigned int totalBlocks = dir->blockMap_.size() - CPM_DIRECTORY_BLOCKS;
+
+	std::memset(buf, 0, sizeof(*buf));
+	buf->f_bsize   = CPM_BLOCK_SIZE;
+	buf->f_frsize  = CPM_BLOCK_SIZE;
+	buf->f_blocks  = totalBlocks;
+	buf->f_bfree   = dir->freeBlocks_ - std::min(dir->freeBlocks_, reservedBlocks);
+	buf->f_bavail  = buf->f_bfree;
+	buf->f_files   = dir->size();
+	buf->f_ffree   = dir->freeEntries_ - std::min(dir->freeEntries_, reservedEntries);
+	buf->f_favail  = buf->f_ffree;
+	buf->f_namemax = Format::NAME_MAX_SIZE;
+
+	return 0;
+}
+
+template <typename Format>
+unsigned int CPMEngine<Format>::blocksPerEntry() const
+{
+	return CPM_MAX_ALLOCATION_UNITS;
+}
+
+template <typename Format>
+int CPMEngine<Format>::release(fuse_ino_t ino, struct fuse_file_info* info)
+{
+	const auto ret = flush(ino, info);
+
+	if (!staging_)
+		return ret;
+
+	// The last handle gives the staged copy up
+	std::unique_lock<std::shared_mutex> lock(fileMutex(ino));
+
+	const auto dir  = fatEntries_.load();
+	const auto slot = find(*dir, ino);
+
+	if (!slot)
+		return ret;
+
+	const auto staged = staging(slot.value());
+
+	if (!staged || --staged->handles_)
+		return ret;
+
+	const auto written = writeBack(slot.value(), *staged);
+
+	// reads come from the disk rather than the staged copy from now on
+	if (!written)
+		invalidate(ino, (*dir)[slot.value()].name(), true);
+
+	std::lock_guard<std::mutex> stagedLock(stagedMutex_);
+
+	staged_.erase(slot.value());
+
+	return ret < 0 ? ret : written;
+}
+
+template <typename Format>
+int CPMEngine<Format>::readdir(fuse_ino_t ino, void* buf, fuse_fill_dir_t cb, off_t /* offset */, struct fuse_file_info* /* info */,
+                               enum fuse_readdir_flags /* flags */)
+{
+	if (ino != FUSE_ROOT_ID)
+		return -ENOENT;
+
+	const auto dir = fatEntries_.load();
+
+	for (unsigned int slot = 0; slot < dir->size(); slot++) {
+		const auto& entry = (*dir)[slot];
+
+		if (entry.free() || entry.extent())
+			continue;
+
+		struct stat st{};
+
+		st.st_ino     = inode(slot);
+		st.st_mode    = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+		st.st_nlink   = 1;
+		st.st_size    = exactSize(slot, fileSize(*dir, slot));
+		st.st_blksize = disk_->properties().sectorSize();
+		st.st_blocks  = st.st_size / 512 + (st.st_size % 512 ? 1 : 0);
+
+		if (cb(buf, entry.name().c_str(), &st, 0, static_cast<fuse_fill_dir_flags>(0)))
+			break;
+	}
+
+	return 0;
+}
+
+template <typename Format>
+int CPMEngine<Format>::create(fuse_ino_t parent, const char* name, mode_t /* mode */, struct stat* buf, struct fuse_file_info* /* info */)
+{
+	if (parent != FUSE_ROOT_ID)
+		return -ENOENT;
+
+	if (!FATEntry::storable(name))
+		return -ENAMETOOLONG;
+
+	std::unique_lock<std::shared_mutex> lock(dirMutex_);
+
+	auto dir = std::make_shared<Directory>(*fatEntries_.load());
+
+	if (find(*dir, std::string(name)))
+		return -EEXIST;
+
+	// The entries promised to the data held by open files are not free
+	unsigned int reservedEntries = 0;
+
+	{
+		std::lock_guard<std::mutex> pendingLock(pendingMutex_);
+
+		reservedEntries = reserved({}).second;
+	}
+
+	if (dir->freeEntries_ <= reservedEntries)
+		return -ENOSPC;
+
+	for (unsigned int slot = 0; slot < dir->size(); slot++) {
+		auto& entry = (*dir)[slot];
+
+		if (!entry.free())
+			continue;
+
+		entry.clear();
+		entry.userCode_ = 0;
+		entry.setName(name);
+
+		dir->account(entry);
+
+		// the new file is open already
+		if (staging_) {
+			Staged staged;
+			staged.handles_ = 1;
+
+			std::lock_guard<std::mutex> stagedLock(stagedMutex_);
+
+			staged_.insert_or_assign(slot, std::move(staged));
+		}
+
+		fatEntries_.store(dir);
+
+		forgetMisses();
+		invalidate(FUSE_ROOT_ID, "", false);
+
+		fillStat(*dir, slot, buf);
+
+		return 0;
+	}
+
+	return -ENOSPC;
+}
+
+template <typename Format>
+void CPMEngine<Format>::dumpFAT() const
+{
+	std::vector<unsigned char> buf;
+
+	for (unsigned int block = 0; block < CPM_DIRECTORY_BLOCKS; block++) {
+		if (!readBlock(block, buf) || buf.empty())
+			std::cerr << "Warning: no data read for block #" << block + 1 << "\n";
+		else
+			hexdump(buf.data(), buf.size());
+	}
+}
+
+template <typename Format>
+void CPMEngine<Format>::printFAT() const
+{
+	unsigned int n = 0;
+
+	for (const auto& entry : *fatEntries_.load()) {
+		if (!entry.free()) {
+			std::cout << "entry: " << n++ << "\n";
+			std::cout << "\tname: \"" << entry.name() << "\"";
+
+			if (entry.name_.at(8) & 0x80)
+				std::cout << " (read-only)";
+
+			if (entry.name_.at(9) & 0x80)
+				std::cout << " (hidden)";
+
+			if (entry.extent())
+				std::cout << " (extent)";
+
+			std::cout << "\n";
+
+			std::cout << "\trecord count: " << static_cast<unsigned int>(entry.recordCount_) << "\n";
+			std::cout << "\tallocation units: ";
+
+			for (const auto unit : entry.allocationUnits_)
+				std::cout << std::hex << std::setw(2 * sizeof(unit)) << std::setfill('0') << static_cast<unsigned int>(unit) << " ";
+
+			std::cout << std::dec << "\n";
+		}
+	}
+}
+
+template class CPMEngine<CPMFormat>;
+template class CPMEngine<HCFormat>;
@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: GPL-2.0
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <expected>
+#include <functional>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "disk.h"
+#include "filesystem.h"
+#include "namekeys.h"
+
+// Name field of a directory entry: 8 + 3 characters on CP/M, other
+// formats split it differently
+using CPMName = std::array<char, 11>;
+
+// CP/M-family filesystem laid out by Format, which provides
+//	dpb_                      the disk parameter block, constexpr
+//	interleave(sectors)       the sector skew for a track of that many
+//	                          sectors, empty if unsupported
+//	decodeName(raw)           file name of a name field, attribute bits set
+//	encodeName(name, raw)     the reverse, leaving raw space padded
+//	NAME_MAX_SIZE             longest file name decodeName() returns
+// All the geometry below derives from the DPB at compile time.
+template <typename Format>
+class CPMEngine final : public Filesystem {
+	static constexpr auto& dpb_ = Format::dpb_;
+
+	static constexpr auto CPM_RECORD_SIZE        = 128u;
+	static constexpr auto CPM_BLOCK_SIZE         = CPM_RECORD_SIZE << dpb_.bsh_;
+	static constexpr unsigned char CPM_FREE_BYTE = 0xe5;
+	static constexpr fuse_ino_t CPM_FIRST_INODE  = FUSE_ROOT_ID + 1;
+
+	// 8 bit allocation units while the blocks fit, 16 bit ones otherwise
+	using AllocationUnit = std::conditional_t<(dpb_.dsm_ > 255), unsigned short, unsigned char>;
+
+	static constexpr auto CPM_MAX_ALLOCATION_UNITS = 16u / sizeof(AllocationUnit);
+
+	// An entry holds exm_ + 1 logical extents of 16K each
+	static constexpr auto CPM_EXTENTS_PER_ENTRY  = dpb_.exm_ + 1u;
+	static constexpr auto CPM_RECORDS_PER_EXTENT = 128u;
+	static constexpr auto CPM_DIRECTORY_ENTRIES  = dpb_.drm_ + 1u;
+	static constexpr auto CPM_DIRECTORY_BLOCKS   = static_cast<unsigned int>(std::popcount(static_cast<unsigned int>(dpb_.al0_ << 8 | dpb_.al1_)));
+
+	static_assert(CPM_MAX_ALLOCATION_UNITS * CPM_BLOCK_SIZE == CPM_EXTENTS_PER_ENTRY * CPM_RECORDS_PER_EXTENT * CPM_RECORD_SIZE,
+	              "extent mask does not match the block size");
+
+#pragma pack(push, 1)
+	struct FATEntry {
+		unsigned char userCode_{};
+		CPMName name_{};
+		unsigned char exLo_{};
+		unsigned char reserved_{};
+		unsigned char exHi_{};
+		unsigned char recordCount_{};
+		std::array<AllocationUnit, CPM_MAX_ALLOCATION_UNITS> allocationUnits_{};
+
+		void clear()
+		{
+			userCode_ = CPM_FREE_BYTE;
+
+			name_.fill(' ');
+
+			exLo_        = 0;
+			reserved_    = 0;
+			exHi_        = 0;
+			recordCount_ = 0;
+
+			allocationUnits_.fill(0);
+		}
+
+		bool free() const
+		{
+			return (userCode_ == CPM_FREE_BYTE);
+		}
+
+		// Whether the entry is not the first one of its file
+		bool extent() const
+		{
+			return number() >= CPM_EXTENTS_PER_ENTRY;
+		}
+
+		unsigned int number() const
+		{
+			return exHi_ * 32 + exLo_;
+		}
+
+		std::string name() const
+		{
+			return Format::decodeName(name_);
+		}
+
+		void setName(const std::string& name)
+		{
+			Format::encodeName(name, name_);
+		}
+
+		// Whether name reads back the same once stored, rather than cut
+		// short
+		static bool storable(const std::string& name)
+		{
+			CPMName raw{};
+
+			Format::encodeName(name, raw);
+
+			return Format::decodeName(raw) == name;
+		}
+
+		// Whether both entries are extents of the same file
+		bool sameFile(const FATEntry& other) const
+		{
+			auto eq = [](const auto& a, const auto& b) {
+				return (a & 0x7f) == (b & 0x7f);
+			};
+
+			return userCode_ == other.userCode_ && std::equal(name_.begin(), name_.end(), other.name_.begin(), eq);
+		}
+
+		unsigned int size() const
+		{
+			return ((exLo_ & dpb_.exm_) * CPM_RECORDS_PER_EXTENT + recordCount_) * CPM_RECORD_SIZE;
+		}
+
+		// Sets the extent number and the record count of the ordinal-th
+		// entry of a file holding records records
+		void setRecords(unsigned int ordinal, unsigned int records)
+		{
+			const auto last = records ? (records - 1) / CPM_RECORDS_PER_EXTENT : 0;
+			const auto n    = ordinal * CPM_EXTENTS_PER_ENTRY + last;
+
+			exLo_        = n % 32;
+			exHi_        = n / 32;
+			recordCount_ = records - last * CPM_RECORDS_PER_EXTENT;
+		}
+
+		unsigned int blocks() const
+		{
+			return std::count_if(allocationUnits_.begin(), allocationUnits_.end(), [](const auto& v) {
+				return v != 0;
+			});
+		}
+	};
+#pragma pack(pop)
+
+	static_assert(sizeof(FATEntry) == 32);
+
+	// Directory entries along with the block allocation and the name keys
+	// they imply, which writers keep in step by going through account() and
+	// release()
+	struct Directory : std::vector<FATEntry> {
+		NameKeys names_;
+		std::vector<bool> blockMap_;        // free data blocks
+		std::vector<bool> freed_;           // blocks freed since loading
+		std::vector<uint64_t> generations_; // by slot, bumped on freeing
+		unsigned int freeBlocks_{};
+		unsigned int freeEntries_{};
+		unsigned int files_{};
+
+		// Counts in an entry that just got used
+		void account(const FATEntry& entry)
+		{
+			if (entry.free())
+				return;
+
+			freeEntries_--;
+
+			if (!entry.extent()) {
+				names_.set(&entry - this->data(), entry.name());
+				files_++;
+			}
+
+			for (const auto au : entry.allocationUnits_) {
+				if (au < blockMap_.size() && blockMap_[au]) {
+					blockMap_[au] = false;
+					freeBlocks_--;
+				}
+			}
+		}
+
+		// Renames an entry, keeping the attribute bits of its name
+		void rename(FATEntry& entry, const std::string& name)
+		{
+			auto renamed = entry;
+			renamed.setName(name);
+
+			auto keep = [](const auto& c, const auto& old) {
+				return static_cast<char>((c & 0x7f) | (old & 0x80));
+			};
+
+			std::transform(renamed.name_.begin(), renamed.name_.end(), entry.name_.begin(), entry.name_.begin(), keep);
+
+			if (!entry.free() && !entry.extent())
+				names_.set(&entry - this->data(), entry.name());
+		}
+
+		// Frees an entry along with its blocks
+		void release(FATEntry& entry)
+		{
+			if (entry.free())
+				return;
+
+			freeEntries_++;
+
+			if (!entry.extent()) {
+				names_.clear(&entry - this->data());
+				files_--;
+			}
+
+			for (const auto au : entry.allocationUnits_)
+				freeBlock(au);
+
+			entry.clear();
+
+			// the slot's inode number may now go to another file
+			generations_[&entry - this->data()]++;
+		}
+
+		// Takes n free blocks, carrying on right after block after while
+		// those are free, then from the smallest free run that fits, the
+		// nearest to after among equals, or else the longest one. Caller
+		// checks freeBlocks_ first.
+		std::pmr::vector<unsigned short> allocateBlocks(unsigned int n, unsigned short after)
+		{
+			std::pmr::vector<unsigned short> ret(arena());
+
+			auto take = [&](unsigned int start, unsigned int length) {
+				for (auto block = start; block < start + length; block++) {
+					blockMap_[block] = false;
+					ret.push_back(block);
+				}
+
+				freeBlocks_ -= length;
+				n -= length;
+				after = start + length - 1;
+			};
+
+			auto distance = [&after](unsigned int block) {
+				return block > after ? block - after : after - block;
+			};
+
+			if (after) {
+				unsigned int length = 0;
+
+				while (length < n && after + 1 + length < blockMap_.size() && blockMap_[after + 1 + length])
+					length++;
+
+				if (length)
+					take(after + 1, length);
+			}
+
+			while (n) {
+				unsigned int best       = 0;
+				unsigned int bestLength = 0;
+
+				for (unsigned int start = 0; start < blockMap_.size();) {
+					if (!blockMap_[start]) {
+						start++;
+						continue;
+					}
+
+					auto end = start;
+					while (end < blockMap_.size() && blockMap_[end])
+						end++;
+
+					const auto length = end - start;
+					const auto fits   = length >= n;
+
+					if (bestLength < n ? (fits || length > bestLength)
+					                   : (fits && (length < bestLength || (length == bestLength && distance(start) < distance(best))))) {
+						best       = start;
+						bestLength = length;
+					}
+
+					start = end;
+				}
+
+				if (!bestLength)
+					break;
+
+				take(best, std::min(n, bestLength));
+			}
+
+			return ret;
+		}
+
+		void freeBlock(unsigned short au)
+		{
+			// the first blocks hold the directory
+			if (au >= CPM_DIRECTORY_BLOCKS && au < blockMap_.size() && !blockMap_[au]) {
+				blockMap_[au] = true;
+				freed_[au]    = true;
+				freeBlocks_++;
+			}
+		}
+	};
+
+	// Readers work on the snapshot they load, writers copy it and publish
+	// the new table under dirMutex_
+	std::atomic<std::shared_ptr<const Directory>> fatEntries_;
+
+	Disk* disk_{};
+
+	const std::span<const unsigned char> interleave_;
+
+	const unsigned int firstBlock_{};
+
+	const bool staging_{};
+
+	// The sector and block accessors fail with -EIO past the end of the
+	// disk, as a corrupt directory can have them
+	std::expected<unsigned int, int> ipos(unsigned int pos) const;
+
+	std::expected<void, int> readBlock(unsigned int block, std::vector<unsigned char>& buf) const;
+
+	std::expected<void, int> writeBlock(unsigned int block, std::span<const unsigned char> buf) const;
+
+	// The directory blocks as last read or written
+	std::vector<unsigned char> savedFAT_;
+
+	void loadFAT();
+
+	std::expected<void, int> saveFAT();
+
+	std::optional<unsigned int> find(const Directory& dir, const std::string& name) const;
+
+	std::optional<unsigned int> find(const Directory& dir, fuse_ino_t ino) const;
+
+	static fuse_ino_t inode(unsigned int slot)
+	{
+		return CPM_FIRST_INODE + slot;
+	}
+
+	// Slots of the file's extents in extent order
+	std::pmr::vector<unsigned int> extents(const Directory& dir, unsigned int slot) const;
+
+	unsigned int fileSize(const Directory& dir, unsigned int slot) const;
+
+	// Data blocks of the file in extent order, returns the file size
+	unsigned int blockList(const Directory& dir, unsigned int slot, std::pmr::vector<unsigned short>& blocks) const;
+
+	// Byte exact sizes of the files written during this session, by slot.
+	// The directory itself only counts records.
+	std::map<unsigned int, unsigned int> exactSizes_;
+	mutable std::mutex exactSizesMutex_;
+
+	// size: the file size in whole records
+	unsigned int exactSize(unsigned int slot, unsigned int size) const;
+
+	void setExactSize(unsigned int slot, unsigned int size);
+
+	// Also drops the pending and the staged data of the slot
+	void dropExactSize(unsigned int slot);
+
+	// Data written past the records of a file, by slot. Blocks only get
+	// allocated once the file is flushed or released, then for the whole
+	// data at once; until then blocks_ and entries_ stay reserved for it.
+	// The map, length_ and the reservation are guarded by pendingMutex_,
+	// start_ and data_ by the file lock, so no copy holds up the others.
+	struct Pending {
+		unsigned int start_{};
+		std::vector<unsigned char> data_;
+		unsigned int length_{}; // the file size the data makes
+		unsigned int blocks_{};
+		unsigned int entries_{};
+	};
+
+	std::map<unsigned int, Pending> pending_;
+	mutable std::mutex pendingMutex_;
+
+	// Blocks and directory entries reserved by the files other than except,
+	// caller holds pendingMutex_
+	std::pair<unsigned int, unsigned int> reserved(std::optional<unsigned int> except) const;
+
+	// Writes out the pending data of the file, caller holds the file lock
+	// exclusively
+	int commit(unsigned int slot);
+
+	// Blocks given to a file but not wiped yet, which read as CPM_FREE_BYTE
+	// until first written to or saved. The mutex is only held for looking
+	// them up, the file lock keeps those of a file from changing meanwhile.
+	std::vector<bool> unwritten_;
+	mutable std::mutex unwrittenMutex_;
+
+	// Storage of a fuse_bufvec over the sectors holding [offset, offset + size)
+	// of the file, for writing when modify is set. It has room for one more
+	// buffer at the end.
+	std::expected<std::pmr::vector<struct fuse_buf>, int> sectorBuffers(const std::pmr::vector<unsigned short>& blocks, off_t offset, size_t size,
+	                                                                    bool modify);
+
+	// Open files held whole in memory when staging, by slot. Reads are
+	// served from data_, writes to the records only land there and mark
+	// their blocks dirty_ until written back. The map is guarded by
+	// stagedMutex_, an entry by the file lock.
+	struct Staged {
+		std::vector<unsigned char> data_; // the records, then the pending data
+		std::vector<bool> dirty_;         // by block index within the file
+		unsigned int size_{};
+		unsigned int handles_{};
+	};
+
+	std::map<unsigned int, Staged> staged_;
+	mutable std::mutex stagedMutex_;
+
+	Staged* staging(unsigned int slot);
+
+	// Reads the whole file into staged, caller holds the file lock
+	// exclusively
+	int stage(const Directory& dir, unsigned int slot, Staged& staged);
+
+	// Writes the dirty blocks out, caller holds the file lock exclusively
+	int writeBack(unsigned int slot, Staged& staged);
+
+	void fillStat(const Directory& dir, unsigned int slot, struct stat* buf) const;
+
+	// Caller holds the file and the directory locks exclusively. New blocks
+	// read as wiped unless the caller is going to write all of them.
+	int resize(Directory& dir, unsigned int slot, off_t length, bool wipe = true);
+
+public:
+	// staging: keep open files whole in memory
+	CPMEngine(Disk* disk, bool staging = false);
+
+	~CPMEngine() override;
+
+	int lookup(fuse_ino_t parent, const char* name, struct stat* buf) override;
+
+	int getattr(fuse_ino_t ino, struct stat* buf) override;
+
+	uint64_t generation(fuse_ino_t ino) override;
+
+	int unlink(fuse_ino_t parent, const char* name) override;
+
+	int rename(fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname, unsigned int flags) override;
+
+	int truncate(fuse_ino_t ino, off_t length) override;
+
+	int open(fuse_ino_t ino, struct fuse_file_info* info) override;
+
+	int readBuf(fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* info,
+	            const std::function<int(struct fuse_bufvec*)>& reply) override;
+
+	int writeBuf(fuse_ino_t ino, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* info) override;
+
+	ssize_t copyFileRange(fuse_ino_t inoIn, off_t offsetIn, struct fuse_file_info* infoIn, fuse_ino_t inoOut, off_t offsetOut,
+	                      struct fuse_file_info* infoOut, size_t size) override;
+
+	int statfs(fuse_ino_t ino, struct statvfs* buf) override;
+
+	unsigned int blocksPerEntry() const override;
+
+	int release(fuse_ino_t ino, struct fuse_file_info* info) override;
+
+	int flush(fuse_ino_t ino, struct fuse_file_info* info) override;
+
+	int fsync(fuse_ino_t ino, int datasync, struct fuse_file_info* info) override;
+
+	int fallocate(fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* info) override;
+
+	int readdir(fuse_ino_t ino, void* buf, fuse_fill_dir_t cb, off_t offset, struct fuse_file_info* info, enum fuse_readdir_flags flags) override;
+
+	int create(fuse_ino_t parent, const char* name, mode_t mode, struct stat* buf, struct fuse_file_info* info) override;
+
+	void dumpFAT() const override;
+
+	void printFAT() const override;
+};
@@ -3,130 +3,20 @@
 
 #include <algorithm>
 #include <array>
-#include <cctype>
-#include <functional>
-#include <optional>
+#include <span>
 #include <string>
 
+#include "cpmengine.h"
 #include "disk.h"
-#include "filesystem.h"
-
-class CPMFS final : public Filesystem {
-	static constexpr auto CPMFS_RECORD_SIZE          = 128u;
-	static constexpr auto CPMFS_BLOCK_SIZE           = 2048u;
-	static constexpr unsigned char CPMFS_FREE_BYTE   = 0xe5;
-	static constexpr auto CPMFS_FILENAME_MAXSIZE     = 8u;
-	static constexpr auto CPMFS_FILETYPE_MAXSIZE     = 3u;
-	static constexpr auto CPMFS_MAX_ALLOCATION_UNITS = 8u;
-
-#pragma pack(push, 1)
-	struct FATEntry {
-		unsigned char userCode_{};
-		std::array<char, CPMFS_FILENAME_MAXSIZE> name_{};
-		std::array<char, CPMFS_FILETYPE_MAXSIZE> type_{};
-		unsigned char exLo_{};
-		unsigned char reserved_{};
-		unsigned char exHi_{};
-		unsigned char recordCount_{};
-		std::array<unsigned short, CPMFS_MAX_ALLOCATION_UNITS> allocationUnits_{};
-
-		void clear()
-		{
-			userCode_ = CPMFS_FREE_BYTE;
-
-			name_.fill(' ');
-			type_.fill(' ');
-
-			exLo_        = 0;
-			reserved_    = 0;
-			exHi_        = 0;
-			recordCount_ = 0;
-
-			allocationUnits_.fill(0);
-		}
-
-		bool free() const
-		{
-			return (userCode_ == CPMFS_FREE_BYTE);
-		}
-
-		bool extent() const
-		{
-			return exLo_ || exHi_;
-		}
-
-		bool full() const
-		{
-			return (recordCount_ >= (allocationUnits_.size() * CPMFS_BLOCK_SIZE / CPMFS_RECORD_SIZE));
-		}
-
-		std::string name() const
-		{
-			std::string ret;
-			ret.reserve(name_.size() + type_.size() + 1);
-
-			for (const auto& c : name_)
-				ret += c & 0x7f;
-
-			while (!ret.empty() && ret.back() == ' ')
-				ret.pop_back();
-
-			const auto c = std::count_if(type_.begin(), type_.end(), [](const auto& v) {
-				return v != ' ';
-			});
-
-			if (c) {
-				ret += '.';
-
-				for (const auto& c : type_)
-					ret += c & 0x7f;
-
-				while (!ret.empty() && ret.back() == ' ')
-					ret.pop_back();
-			}
-
-			return ret;
-		}
-
-		void setName(const std::string& name)
-		{
-			name_.fill(' ');
-			type_.fill(' ');
-
-			const auto p = name.rfind('.');
-			if (p == std::string::npos)
-				std::copy_n(name.begin(), std::min(name.length(), name_.size()), name_.begin());
-			else {
-				std::copy_n(name.begin(), std::min(p, name_.size()), name_.begin());
-				if (p < name.length())
-					std::copy_n(name.begin() + p + 1, std::min(name.length() - p, type_.size()), type_.begin());
-			}
-		}
 
-		bool operator==(const std::string& other) const
-		{
-			return name() == other;
-		}
-
-		unsigned int size() const
-		{
-			return recordCount_ * CPMFS_RECORD_SIZE;
-		}
-
-		unsigned int blocks() const
-		{
-			return std::count_if(allocationUnits_.begin(), allocationUnits_.end(), [](const auto& v) {
-				return v != 0;
-			});
-		}
-	};
-#pragma pack(pop)
-
-	static constexpr auto interleave_ = std::to_array<unsigned char>({0, 2, 4, 6, 8, 1, 3, 5, 7});
+// CP/M 2.2 3.5" format, 8.3 file names
+struct CPMFormat {
+	static constexpr auto FILENAME_MAXSIZE = 8u;
+	static constexpr auto FILETYPE_MAXSIZE = 3u;
+	static constexpr auto NAME_MAX_SIZE    = FILENAME_MAXSIZE + FILETYPE_MAXSIZE + 1;
 
-	// CP/M 2.2 3.5" format
 	// clang-format off
-	inline static const DiskParameterBlock dpb_ = {
+	static constexpr DiskParameterBlock dpb_ = {
 		.spt_ = 32,
 		.bsh_ = 4,
 		.blm_ = 15,
@@ -140,51 +30,60 @@ class CPMFS final : public Filesystem {
 	};
 	// clang-format on
 
-	std::vector<FATEntry> fatEntries_;
-
-	Disk* disk_{};
-
-	const unsigned int firstBlock_{};
-
-	unsigned int ipos(unsigned int pos) const;
+	static std::span<const unsigned char> interleave(unsigned int sectors)
+	{
+		static constexpr auto interleave9 = std::to_array<unsigned char>({0, 2, 4, 6, 8, 1, 3, 5, 7});
 
-	void readBlock(unsigned int block, std::vector<unsigned char>& buf) const;
+		if (sectors == interleave9.size())
+			return interleave9;
 
-	void writeBlock(unsigned int block, const std::vector<unsigned char>& buf) const;
+		return {};
+	}
 
-	void loadFAT();
+	static std::string decodeName(const CPMName& raw)
+	{
+		const auto type = raw.begin() + FILENAME_MAXSIZE;
 
-	void saveFAT() const;
+		std::string ret;
+		ret.reserve(NAME_MAX_SIZE);
 
-	std::optional<std::reference_wrapper<FATEntry>> find(const std::string& path);
+		for (auto it = raw.begin(); it != type; ++it)
+			ret += *it & 0x7f;
 
-public:
-	CPMFS(Disk* disk);
+		while (!ret.empty() && ret.back() == ' ')
+			ret.pop_back();
 
-	~CPMFS() override;
+		const auto c = std::count_if(type, raw.end(), [](const auto& v) {
+			return v != ' ';
+		});
 
-	int getattr(const char* path, struct stat* buf, struct fuse_file_info* info) override;
+		if (c) {
+			ret += '.';
 
-	int unlink(const char* path) override;
+			for (auto it = type; it != raw.end(); ++it)
+				ret += *it & 0x7f;
 
-	int truncate(const char* path, off_t length, struct fuse_file_info* info) override;
-
-	int open(const char* path, struct fuse_file_info* info) override;
-
-	int read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* info) override;
-
-	int write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* info) override;
-
-	int statfs(const char* path, struct statvfs* buf) override;
+			while (!ret.empty() && ret.back() == ' ')
+				ret.pop_back();
+		}
 
-	int release(const char* path, struct fuse_file_info* info) override;
+		return ret;
+	}
 
-	int readdir(const char* path, void* buf, fuse_fill_dir_t cb, off_t offset, struct fuse_file_info* info,
-	            enum fuse_readdir_flags flags) override;
+	static void encodeName(const std::string& name, CPMName& raw)
+	{
+		raw.fill(' ');
 
-	int create(const char* path, mode_t mode, struct fuse_file_info* info) override;
+		const auto p = name.rfind('.');
+		if (p == std::string::npos)
+			std::copy_n(name.begin(), std::min<size_t>(name.length(), FILENAME_MAXSIZE), raw.begin());
+		else {
+			std::copy_n(name.begin(), std::min<size_t>(p, FILENAME_MAXSIZE), raw.begin());
+			std::copy_n(name.begin() + p + 1, std::min<size_t>(name.length() - p - 1, FILETYPE_MAXSIZE), raw.begin() + FILENAME_MAXSIZE);
+		}
+	}
+};
 
-	void dumpFAT() const override;
+extern template class CPMEngine<CPMFormat>;
 
-	void printFAT() const override;
-};
+using CPMFS = CPMEngine<CPMFormat>;
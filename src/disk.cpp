@@ -1,4 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0
+#include <format>
+#include <fstream>
+#include <stdexcept>
+
 #include "disk.h"
 #include "dsk.h"
 #include "imd.h"
@@ -13,3 +17,47 @@ std::unique_ptr<Disk> Disk::create(const fs::path& path)
 
 	return {};
 }
+
+void Disk::save(const fs::path& path) const
+{
+	// a link keeps pointing at the image
+	const auto target = fs::is_symlink(path) ? fs::canonical(path) : path;
+
+	auto tmp = target;
+	tmp += ".tmp";
+
+	try {
+		std::ofstream of(tmp, std::ios_base::trunc);
+		if (!of)
+			throw std::runtime_error(std::format("failed to write {}", tmp.string()));
+
+		save(of);
+
+		of.close();
+		if (!of)
+			throw std::runtime_error(std::format("failed to write {}", tmp.string()));
+
+		// with the permissions of the image it replaces
+		std::error_code ec;
+
+		const auto status = fs::status(target, ec);
+		if (!ec)
+			fs::permissions(tmp, status.permissions());
+
+		fs::rename(tmp, target);
+	} catch (...) {
+		std::error_code ec;
+
+		fs::remove(tmp, ec);
+
+		throw;
+	}
+}
+
+std::unique_ptr<Disk> Disk::create(const fs::path& path, const DiskProperties& properties)
+{
+	if (path.extension() == ".imd" || path.extension() == ".IMD")
+		return std::make_unique<IMD>(properties);
+
+	return std::make_unique<DSK>(properties);
+}
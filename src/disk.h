@@ -3,9 +3,12 @@
 
 #include <bit>
 #include <cstdint>
+#include <expected>
 #include <filesystem>
 #include <fstream>
 #include <memory>
+#include <ostream>
+#include <span>
 
 #include "diskproperties.h"
 #include "sector.h"
@@ -36,14 +39,27 @@ public:
 
 	virtual const Sector& read(unsigned int pos) const = 0;
 
-	virtual void write(unsigned int pos, const Sector& sector) = 0;
+	// Fails with -EINVAL for a position or a size the geometry does not have
+	virtual std::expected<void, int> write(unsigned int pos, const Sector& sector) = 0;
 
-	virtual void save(const fs::path& path) const = 0;
+	// In place access to a sector's contents for writing, a missing sector
+	// gets created first. Marks the disk as modified.
+	virtual std::expected<std::span<unsigned char>, int> modify(unsigned int pos) = 0;
+
+	virtual void save(std::ostream& of) const = 0;
+
+	// Replaces the file at path with the image, through a file written next
+	// to it and renamed over it so that a failed save leaves it as it was
+	void save(const fs::path& path) const;
 
 	virtual bool modified() const = 0;
 
 	static std::unique_ptr<Disk> create(const fs::path& path);
 
+	// A blank disk to be saved to path, as IMD if its extension is .imd
+	// and as DSK otherwise
+	static std::unique_ptr<Disk> create(const fs::path& path, const DiskProperties& properties);
+
 	static std::uint8_t read8(std::ifstream& in)
 	{
 		char buf = '\0';
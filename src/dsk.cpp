@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <algorithm>
+#include <cerrno>
 #include <fstream>
+#include <mutex>
 #include <stdexcept>
 
 #include "diskpos.h"
@@ -10,6 +12,10 @@
 constexpr auto DATA_ALIGNMENT   = 256l;
 constexpr auto SECTOR_SIZE_UNIT = 256u;
 
+// The sector table of a track has to fit before its data, which starts
+// DATA_ALIGNMENT bytes in: 24 bytes of header, 8 for each sector
+constexpr auto MAX_SECTORS = (DATA_ALIGNMENT - 24) / 8;
+
 DSK::DSK(const fs::path& path)
 {
 	std::ifstream in(path);
@@ -211,8 +217,75 @@ DSK::DSK(const fs::path& path)
 	}
 }
 
+DSK::DSK(const DiskProperties& properties)
+    : properties_{properties}
+{
+	if (properties_.tracks() > 0xff || properties_.heads() > 2 || properties_.sectors() > MAX_SECTORS || !properties_.sectorSize()
+	    || properties_.sectorSize() % SECTOR_SIZE_UNIT)
+		throw std::runtime_error("unsupported geometry");
+
+	const Sector fill(std::vector<unsigned char>(properties_.sectorSize(), 0xe5));
+
+	tracks_.reserve(properties_.tracks() * properties_.heads());
+
+	for (unsigned int t = 0; t < properties_.tracks(); t++) {
+		for (unsigned int s = 0; s < properties_.heads(); s++) {
+			tracks_.push_back(blankTrack(t, s, fill));
+			mapTrack(tracks_.back());
+		}
+	}
+
+	modified_ = true;
+}
+
+DSK::Track DSK::blankTrack(unsigned char track, unsigned char side, const Sector& fill) const
+{
+	Track ret;
+
+	ret.track_       = track;
+	ret.side_        = side;
+	ret.sectorSize_  = properties_.sectorSize() / SECTOR_SIZE_UNIT;
+	ret.sectorCount_ = properties_.sectors();
+
+	// PC-compatible disk controllers do not use a gap but drivers
+	// specify 0x1b (27) just in case.
+	ret.gap_ = 0x1b;
+
+	ret.filler_ = 0xe5;
+
+	ret.sectorInfos_.reserve(ret.sectorCount_);
+
+	for (unsigned char i = 0; i < ret.sectorCount_; i++) {
+		SectorInfo info;
+
+		info.track_ = track;
+		info.side_  = side;
+		info.id_    = i + 1;
+		info.size_  = properties_.sectorSize() / SECTOR_SIZE_UNIT;
+
+		if (extended_)
+			info.dataLength_ = properties_.sectorSize();
+
+		ret.sectorInfos_.push_back(info);
+	}
+
+	ret.sectors_.assign(ret.sectorCount_, fill);
+
+	return ret;
+}
+
+void DSK::mapTrack(Track& track)
+{
+	for (unsigned char i = 0; i < track.sectorCount_; i++) {
+		const DiskPos dpos(properties_, track.track_, track.side_, i);
+		sectors_[dpos.pos()] = &track.sectors_[i];
+	}
+}
+
 const Sector& DSK::read(unsigned int pos) const
 {
+	std::shared_lock<std::shared_mutex> lock(mutex_);
+
 	auto it = sectors_.find(pos);
 	if (it != sectors_.end())
 		return *it->second;
@@ -221,69 +294,67 @@ const Sector& DSK::read(unsigned int pos) const
 	return empty;
 }
 
-void DSK::write(unsigned int pos, const Sector& sector)
+std::expected<void, int> DSK::write(unsigned int pos, const Sector& sector)
 {
 	if (pos > properties_.maxPos())
-		throw std::runtime_error(std::format("invalid sector position: {} (max: {})", pos, properties_.maxPos()));
+		return std::unexpected(-EINVAL);
 
 	if (!sector.data().empty() && sector.data().size() != properties_.sectorSize())
-		throw std::runtime_error(std::format("invalid sector size: {} (expected: {})", sector.data().size(), properties_.sectorSize()));
+		return std::unexpected(-EINVAL);
+
+	// Sectors of an existing track are updated in place, only adding a
+	// track has to keep the readers out
+	std::shared_lock<std::shared_mutex> sharedLock(mutex_);
+	std::unique_lock<std::shared_mutex> lock(mutex_, std::defer_lock);
 
 	auto it = sectors_.find(pos);
+	if (it == sectors_.end()) {
+		sharedLock.unlock();
+		lock.lock();
+		it = sectors_.find(pos);
+	}
+
 	if (it != sectors_.end())
 		*it->second = sector;
 	else {
 		const DiskPos dpos(properties_, pos);
 
-		Track track;
-
-		track.track_       = dpos.track();
-		track.side_        = dpos.head();
-		track.sectorSize_  = properties_.sectorSize() / SECTOR_SIZE_UNIT;
-		track.sectorCount_ = properties_.sectors();
+		auto track = blankTrack(dpos.track(), dpos.head(), {});
 
-		// PC-compatible disk controllers do not use a gap but drivers
-		// specify 0x1b (27) just in case.
-		track.gap_ = 0x1b;
+		track.sectors_[dpos.sector()] = sector;
 
-		track.filler_ = 0xe5;
-
-		track.sectorInfos_.reserve(track.sectorCount_);
+		tracks_.push_back(std::move(track));
+		mapTrack(tracks_.back());
+	}
 
-		for (unsigned char i = 0; i < track.sectorCount_; i++) {
-			SectorInfo info;
+	modified_ = true;
 
-			info.track_ = dpos.track();
-			info.side_  = dpos.head();
-			info.id_    = i + 1;
-			info.size_  = properties_.sectorSize() / SECTOR_SIZE_UNIT;
+	return {};
+}
 
-			if (extended_)
-				info.dataLength_ = properties_.sectorSize();
+std::expected<std::span<unsigned char>, int> DSK::modify(unsigned int pos)
+{
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex_);
 
-			track.sectorInfos_.push_back(info);
+		auto it = sectors_.find(pos);
+		if (it != sectors_.end() && it->second->data().size() == properties_.sectorSize()) {
+			modified_ = true;
+			return it->second->data();
 		}
+	}
 
-		track.sectors_.resize(track.sectorCount_);
-		track.sectors_.at(dpos.sector()) = sector;
-
-		for (unsigned char i = 0; i < track.sectorCount_; i++) {
-			const DiskPos __dpos(properties_, track.track_, track.side_, i);
-			sectors_[__dpos.pos()] = &track.sectors_.at(i);
-		}
+	const auto ret = write(pos, Sector(std::vector<unsigned char>(properties_.sectorSize(), 0xe5)));
+	if (!ret)
+		return std::unexpected(ret.error());
 
-		tracks_.push_back(std::move(track));
-	}
+	std::shared_lock<std::shared_mutex> lock(mutex_);
 
-	modified_ = true;
+	return sectors_.find(pos)->second->data();
 }
 
-void DSK::save(const fs::path& path) const
+void DSK::save(std::ostream& of) const
 {
-	std::ofstream of(path, std::ios_base::trunc);
-	if (!of)
-		throw std::runtime_error(std::format("failed to write {}", path.string()));
-
 	if (extended_)
 		of.write(etag.data(), etag.size());
 	else
@@ -361,7 +432,15 @@ void DSK::save(const fs::path& path) const
 			of.write(reinterpret_cast<const char*>(&info.dataLength_), sizeof(info.dataLength_));
 		}
 
-		of.seekp(trackPos + DATA_ALIGNMENT, std::ios_base::beg);
+		// Padding rather than seeking, which cannot grow a stream in memory
+		const auto headerSize = of.tellp() - trackPos;
+
+		if (headerSize > DATA_ALIGNMENT)
+			throw std::runtime_error(std::format("track {} side {} has more than {} sectors", static_cast<unsigned int>(track.track_),
+			                                     static_cast<unsigned int>(track.side_), MAX_SECTORS));
+
+		static const std::array<char, DATA_ALIGNMENT> padding{};
+		of.write(padding.data(), DATA_ALIGNMENT - headerSize);
 
 		for (const auto& sector : track.sectors_)
 			of.write(reinterpret_cast<const char*>(sector.data().data()), static_cast<std::streamsize>(sector.data().size()));
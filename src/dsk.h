@@ -2,8 +2,10 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <filesystem>
 #include <map>
+#include <shared_mutex>
 
 #include "disk.h"
 #include "sector.h"
@@ -33,7 +35,8 @@ class DSK final : public Disk {
 	};
 
 	DiskProperties properties_;
-	bool modified_{};
+	std::atomic<bool> modified_{};
+	mutable std::shared_mutex mutex_;
 	std::vector<unsigned char> trackSizes_;
 	std::vector<Track> tracks_;
 	std::map<unsigned int, Sector*> sectors_;
@@ -46,9 +49,17 @@ class DSK final : public Disk {
 	inline static const auto trackTag = std::to_array({'T', 'r', 'a', 'c', 'k', '-', 'I', 'n', 'f', 'o', '\r', '\n'});
 	bool extended_{};
 
+	// A track of the disk's geometry, all sectors set to fill
+	Track blankTrack(unsigned char track, unsigned char side, const Sector& fill) const;
+
+	void mapTrack(Track& track);
+
 public:
 	DSK(const fs::path& path);
 
+	// A blank disk of the given geometry, formatted with 0xe5
+	DSK(const DiskProperties& properties);
+
 	~DSK() override = default;
 
 	const DiskProperties& properties() const override
@@ -58,9 +69,13 @@ public:
 
 	const Sector& read(unsigned int pos) const override;
 
-	void write(unsigned int pos, const Sector& sector) override;
+	std::expected<void, int> write(unsigned int pos, const Sector& sector) override;
+
+	std::expected<std::span<unsigned char>, int> modify(unsigned int pos) override;
+
+	using Disk::save;
 
-	void save(const fs::path& path) const override;
+	void save(std::ostream& of) const override;
 
 	bool modified() const override
 	{
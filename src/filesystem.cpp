@@ -1,34 +1,492 @@
 // SPDX-License-Identifier: GPL-2.0
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <format>
 #include <iostream>
-#include <mutex>
+#include <memory>
+#include <memory_resource>
+#include <new>
 #include <stdexcept>
+#include <string_view>
+#include <vector>
 
+#include "cpmfs.h"
 #include "filesystem.h"
+#include "hcfs.h"
+
+// Counts the allocations the request arenas hand on to the heap
+class SpillResource final : public std::pmr::memory_resource {
+	std::atomic<unsigned long> count_{};
+
+	void* do_allocate(size_t bytes, size_t alignment) override
+	{
+		count_++;
+
+		return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+	}
+
+	void do_deallocate(void* p, size_t bytes, size_t alignment) override
+	{
+		std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+	{
+		return this == &other;
+	}
+
+public:
+	unsigned long count() const
+	{
+		return count_;
+	}
+};
+
+static SpillResource spills;
+
+// The buffer is taken from the heap once per thread, on its first request
+struct Filesystem::Arena {
+	std::unique_ptr<std::byte[]> buffer_{new std::byte[ARENA_SIZE]};
+	std::pmr::monotonic_buffer_resource resource_{buffer_.get(), ARENA_SIZE, &spills};
+	unsigned int depth_{};
+};
+
+thread_local Filesystem::Arena Filesystem::arena_;
+
+#ifdef COUNT_ALLOCATIONS
+static std::atomic<unsigned long> requestAllocations;
+
+// RequestScope nesting, kept apart from arena_ so that counting does not
+// construct it
+static constinit thread_local unsigned int requestDepth = 0;
+
+// Exported so that the allocations made within libstdc++ get counted too
+[[gnu::visibility("default")]] void* operator new(size_t size)
+{
+	if (requestDepth)
+		requestAllocations++;
+
+	if (const auto p = std::malloc(size ? size : 1))
+		return p;
+
+	throw std::bad_alloc();
+}
+
+[[gnu::visibility("default")]] void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+[[gnu::visibility("default")]] void operator delete(void* p, size_t /* size */) noexcept
+{
+	std::free(p);
+}
+#endif
 
 Filesystem::Filesystem()
 {
-	ops_.getattr  = __getattr;
-	ops_.unlink   = __unlink;
-	ops_.truncate = __truncate;
-	ops_.open     = __open;
-	ops_.read     = __read;
-	ops_.write    = __write;
-	ops_.statfs   = __statfs;
-	ops_.release  = __release;
-	ops_.readdir  = __readdir;
-	ops_.create   = __create;
+	ops_.getattr         = __getattr;
+	ops_.unlink          = __unlink;
+	ops_.rename          = __rename;
+	ops_.truncate        = __truncate;
+	ops_.utimens         = __utimens;
+	ops_.open            = __open;
+	ops_.read            = __read;
+	ops_.read_buf        = __readBuf;
+	ops_.write_buf       = __writeBuf;
+	ops_.statfs          = __statfs;
+	ops_.copy_file_range = __copyFileRange;
+	ops_.release         = __release;
+	ops_.opendir         = __opendir;
+	ops_.readdir         = __readdir;
+	ops_.releasedir      = __releasedir;
+	ops_.create          = __create;
+	ops_.flush           = __flush;
+	ops_.fsync           = __fsync;
+	ops_.fallocate       = __fallocate;
+	ops_.init            = __init;
+	ops_.destroy         = __destroy;
+
+	llops_.lookup          = __lookup;
+	llops_.forget          = __forget;
+	llops_.getattr         = __getattr;
+	llops_.setattr         = __setattr;
+	llops_.unlink          = __unlink;
+	llops_.rename          = __rename;
+	llops_.open            = __open;
+	llops_.read            = __read;
+	llops_.write_buf       = __writeBuf;
+	llops_.statfs          = __statfs;
+	llops_.copy_file_range = __copyFileRange;
+	llops_.release         = __release;
+	llops_.opendir         = __opendir;
+	llops_.readdir         = __readdir;
+	llops_.readdirplus     = __readdirplus;
+	llops_.releasedir      = __releasedir;
+	llops_.create          = __create;
+	llops_.flush           = __flush;
+	llops_.fsync           = __fsync;
+	llops_.fallocate       = __fallocate;
+	llops_.init            = __init;
+	llops_.destroy         = __destroy;
+
+	// so that neither grows while handling requests
+	listings_.reserve(MAX_LISTINGS);
+	misses_.reserve(MAX_MISSES);
+}
+
+std::unique_ptr<Filesystem> Filesystem::create(std::string_view type, Disk* disk, bool staging)
+{
+	if (type == "cpm")
+		return std::make_unique<CPMFS>(disk, staging);
+
+	if (type == "hc")
+		return std::make_unique<HCFS>(disk, staging);
+
+	return {};
+}
+
+Filesystem::RequestScope::RequestScope() noexcept
+{
+	arena_.depth_++;
+
+#ifdef COUNT_ALLOCATIONS
+	requestDepth++;
+#endif
+}
+
+Filesystem::RequestScope::~RequestScope()
+{
+#ifdef COUNT_ALLOCATIONS
+	requestDepth--;
+#endif
+
+	if (!--arena_.depth_)
+		arena_.resource_.release();
+}
+
+std::pmr::memory_resource* Filesystem::arena()
+{
+	return arena_.depth_ ? &arena_.resource_ : std::pmr::get_default_resource();
+}
+
+unsigned long Filesystem::arenaSpills()
+{
+	return spills.count();
+}
+
+unsigned long Filesystem::requestAllocations()
+{
+#ifdef COUNT_ALLOCATIONS
+	return ::requestAllocations;
+#else
+	return 0;
+#endif
+}
+
+const char* Filesystem::rootEntry(const char* path)
+{
+	const std::string_view __path(path);
+
+	if (__path.size() < 2 || __path.front() != '/' || __path.find('/', 1) != std::string_view::npos)
+		return nullptr;
+
+	return path + 1;
+}
+
+int Filesystem::resolve(const char* path, struct stat* buf)
+{
+	if (std::string_view(path) == "/")
+		return getattr(FUSE_ROOT_ID, buf);
+
+	const auto name = rootEntry(path);
+
+	if (!name)
+		return -ENOENT;
+
+	return lookup(FUSE_ROOT_ID, name, buf);
+}
+
+void Filesystem::startInvalidations()
+{
+	std::lock_guard<std::mutex> lock(invalidationMutex_);
+
+	invalidationThread_ = std::jthread([this](std::stop_token stoken) {
+		invalidationLoop(stoken);
+	});
+}
+
+void Filesystem::stopInvalidations()
+{
+	std::jthread thread;
+
+	{
+		std::lock_guard<std::mutex> lock(invalidationMutex_);
+
+		thread = std::move(invalidationThread_);
+		invalidations_.clear();
+	}
+
+	// the thread is stopped and joined when going out of scope
+}
+
+void Filesystem::invalidationLoop(std::stop_token stoken)
+{
+	// Swapped with the queue, both keep their capacity for the next batches
+	std::vector<Invalidation> batch;
+	std::unique_lock<std::mutex> lock(invalidationMutex_);
+
+	while (invalidationCond_.wait(lock, stoken, [this]() {
+		return !invalidations_.empty();
+	})) {
+		batch.swap(invalidations_);
+
+		lock.unlock();
+
+		// Errors only mean the kernel had nothing cached
+		for (const auto& invalidation : batch) {
+			if (session_)
+				fuse_lowlevel_notify_inval_inode(session_, invalidation.ino_, invalidation.data_ ? 0 : -1, 0);
+			else
+				fuse_invalidate_path(fuse_, invalidation.path_.c_str());
+		}
+
+		batch.clear();
+
+		lock.lock();
+	}
+}
+
+void Filesystem::invalidate(fuse_ino_t ino, const std::string& name, bool data)
+{
+	{
+		std::lock_guard<std::mutex> lock(invalidationMutex_);
+
+		// not mounted
+		if (!invalidationThread_.joinable())
+			return;
+
+		invalidations_.push_back({ino, "/" + name, data});
+	}
+
+	invalidationCond_.notify_one();
+}
+
+int Filesystem::openListing(fuse_ino_t ino, struct fuse_file_info* info)
+{
+	struct stat st{};
+
+	const auto ret = getattr(ino, &st);
+	if (ret < 0)
+		return ret;
+
+	if (!S_ISDIR(st.st_mode))
+		return -ENOTDIR;
+
+	std::unique_ptr<DirListing> listing;
+
+	{
+		std::lock_guard<std::mutex> lock(listingsMutex_);
+
+		if (!listings_.empty()) {
+			listing = std::move(listings_.back());
+			listings_.pop_back();
+		}
+	}
+
+	if (!listing)
+		listing = std::make_unique<DirListing>();
+
+	listing->ino_ = ino;
+
+	info->fh = reinterpret_cast<uint64_t>(listing.release());
+
+	return 0;
+}
+
+int Filesystem::list(DirListing& listing, struct fuse_file_info* info)
+{
+	listing.entries_.clear();
+
+	const auto ret = readdir(listing.ino_, &listing, fillListing, 0, info, FUSE_READDIR_PLUS);
+	if (ret < 0)
+		return ret;
+
+	std::sort(listing.entries_.begin(), listing.entries_.end(), [](const auto& a, const auto& b) {
+		return a.name_ < b.name_;
+	});
+
+	for (auto& entry : listing.entries_)
+		owner_.apply(&entry.st_);
+
+	return 0;
+}
+
+void Filesystem::closeListing(struct fuse_file_info* info)
+{
+	std::unique_ptr<DirListing> listing(reinterpret_cast<DirListing*>(info->fh));
+	info->fh = 0;
+
+	// The entries keep their capacity for the next listing
+	listing->entries_.clear();
+
+	std::lock_guard<std::mutex> lock(listingsMutex_);
+
+	if (listings_.size() < MAX_LISTINGS)
+		listings_.push_back(std::move(listing));
+}
+
+int Filesystem::fillListing(void* buf, const char* name, const struct stat* st, off_t /* offset */, enum fuse_fill_dir_flags /* flags */)
+{
+	static_cast<DirListing*>(buf)->entries_.push_back({name, *st});
+
+	return 0;
+}
+
+void Filesystem::replyListing(fuse_req_t req, size_t size, off_t offset, struct fuse_file_info* info, bool plus) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+	std::pmr::vector<char> buf(arena());
+	size_t used = 0;
+
+	try {
+		auto __this  = static_cast<Filesystem*>(fuse_req_userdata(req));
+		auto listing = reinterpret_cast<DirListing*>(info->fh);
+
+		buf.resize(size);
+
+		ret = offset ? 0 : __this->list(*listing, info);
+
+		for (auto i = static_cast<size_t>(offset); !ret && i < listing->entries_.size(); i++) {
+			const auto& entry = listing->entries_.at(i);
+			const auto rest   = buf.size() - used;
+			size_t n          = 0;
+
+			if (plus) {
+				struct fuse_entry_param param{};
+
+				param.ino           = entry.st_.st_ino;
+				param.generation    = __this->generation(param.ino);
+				param.attr          = entry.st_;
+				param.attr_timeout  = ATTR_TIMEOUT;
+				param.entry_timeout = ENTRY_TIMEOUT;
+
+				n = fuse_add_direntry_plus(req, buf.data() + used, rest, entry.name_.c_str(), &param, i + 1);
+			} else
+				n = fuse_add_direntry(req, buf.data() + used, rest, entry.name_.c_str(), &entry.st_, i + 1);
+
+			if (n > rest)
+				break;
+
+			used += n;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_buf(req, buf.data(), used);
+}
+
+bool Filesystem::missed(const std::string& name, unsigned long& generation)
+{
+	std::shared_lock<std::shared_mutex> lock(missesMutex_);
+
+	generation = missesGeneration_;
+
+	return misses_.contains(std::string_view(name));
+}
+
+void Filesystem::rememberMiss(const std::string& name, unsigned long generation)
+{
+	std::unique_lock<std::shared_mutex> lock(missesMutex_);
+
+	// a name got created since the lookup started
+	if (generation != missesGeneration_)
+		return;
+
+	if (misses_.size() >= MAX_MISSES)
+		misses_.clear();
+
+	misses_.emplace(std::string_view(name));
+}
+
+void Filesystem::forgetMisses()
+{
+	std::unique_lock<std::shared_mutex> lock(missesMutex_);
+
+	misses_.clear();
+	missesGeneration_++;
+}
+
+void* Filesystem::__init(struct fuse_conn_info* conn, struct fuse_config* cfg) noexcept
+{
+	auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
+
+	// Let the kernel merge small writes in its page cache, the sizes it
+	// then keeps for itself match getattr() since those are byte exact
+	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+
+	// Transfers are copied between the fuse device and the sector buffers
+	// through pipes, see readBuf() and writeBuf()
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+	conn->max_write     = MAX_WRITE;
+	conn->max_readahead = MAX_WRITE;
+
+	// libfuse refuses a size other than the -o max_read= one
+	if (__this->maxRead_)
+		conn->max_read = __this->maxRead_;
+
+	cfg->entry_timeout    = ENTRY_TIMEOUT;
+	cfg->attr_timeout     = ATTR_TIMEOUT;
+	cfg->negative_timeout = NEGATIVE_TIMEOUT;
+
+	try {
+		__this->fuse_ = fuse_get_context()->fuse;
+		__this->startInvalidations();
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	return __this;
+}
+
+void Filesystem::__destroy(void* userdata) noexcept
+{
+	try {
+		static_cast<Filesystem*>(userdata)->stopInvalidations();
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	// A sign that ARENA_SIZE no longer fits the largest requests
+	if (const auto spilled = arenaSpills())
+		std::cerr << "Warning: " << spilled << " request allocations did not fit into the per-thread arena\n";
+
+#ifdef COUNT_ALLOCATIONS
+	std::cerr << "Info: " << requestAllocations() << " heap allocations while handling requests\n";
+#endif
 }
 
-int Filesystem::__getattr(const char* path, struct stat* buf, struct fuse_file_info* info) noexcept
+int Filesystem::__getattr(const char* path, struct stat* buf, struct fuse_file_info* /* info */) noexcept
 {
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::shared_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->getattr(path, buf, info);
+		ret = __this->resolve(path, buf);
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -38,13 +496,63 @@ int Filesystem::__getattr(const char* path, struct stat* buf, struct fuse_file_i
 
 int Filesystem::__unlink(const char* path) noexcept
 {
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
+
+		const auto name = rootEntry(path);
+
+		if (!name)
+			return -ENOENT;
+
+		ret = __this->unlink(FUSE_ROOT_ID, name);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	return ret;
+}
+
+int Filesystem::__rename(const char* from, const char* to, unsigned int flags) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
+
+		const auto name    = rootEntry(from);
+		const auto newname = rootEntry(to);
+
+		if (!name || !newname)
+			return -ENOENT;
+
+		ret = __this->rename(FUSE_ROOT_ID, name, FUSE_ROOT_ID, newname, flags);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	return ret;
+}
+
+int Filesystem::__truncate(const char* path, off_t length, struct fuse_file_info* /* info */) noexcept
+{
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::unique_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->unlink(path);
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->truncate(st.st_ino, length);
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -52,15 +560,20 @@ int Filesystem::__unlink(const char* path) noexcept
 	return ret;
 }
 
-int Filesystem::__truncate(const char* path, off_t length, struct fuse_file_info* info) noexcept
+int Filesystem::__utimens(const char* path, const struct timespec /* tv */[2], struct fuse_file_info* /* info */) noexcept
 {
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::unique_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->truncate(path, length, info);
+		// The directory entries have no time stamps, which the writeback
+		// cache still sets along with the data: accepted for any file
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -70,13 +583,21 @@ int Filesystem::__truncate(const char* path, off_t length, struct fuse_file_info
 
 int Filesystem::__open(const char* path, struct fuse_file_info* info) noexcept
 {
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::shared_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->open(path, info);
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->open(st.st_ino, info);
+
+		// the page cache only goes stale through invalidate()
+		info->keep_cache = 1;
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -86,13 +607,18 @@ int Filesystem::__open(const char* path, struct fuse_file_info* info) noexcept
 
 int Filesystem::__read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* info) noexcept
 {
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::shared_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->read(path, buf, size, offset, info);
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->read(st.st_ino, buf, size, offset, info);
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -100,15 +626,50 @@ int Filesystem::__read(const char* path, char* buf, size_t size, off_t offset, s
 	return ret;
 }
 
-int Filesystem::__write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* info) noexcept
+int Filesystem::__readBuf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* info) noexcept
 {
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::unique_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->write(path, buf, size, offset, info);
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->readBuf(st.st_ino, size, offset, info, [bufp, size](struct fuse_bufvec* src) {
+				// libfuse frees what it gets once replied, and the sectors
+				// only stay put until this returns, hence the one copy
+				auto dst = static_cast<struct fuse_bufvec*>(std::malloc(sizeof(struct fuse_bufvec)));
+				auto mem = std::malloc(size ? size : 1);
+
+				if (!dst || !mem) {
+					std::free(dst);
+					std::free(mem);
+					return -ENOMEM;
+				}
+
+				*dst            = FUSE_BUFVEC_INIT(size);
+				dst->buf[0].mem = mem;
+
+				const auto copied = fuse_buf_copy(dst, src, static_cast<fuse_buf_copy_flags>(0));
+				if (copied < 0) {
+					std::free(mem);
+					std::free(dst);
+					return static_cast<int>(copied);
+				}
+
+				dst->buf[0].size = copied;
+				*bufp            = dst;
+
+				return 0;
+			});
+
+		// libfuse replies with whatever *bufp holds on success
+		if (!ret && !*bufp)
+			ret = -EIO;
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -116,15 +677,20 @@ int Filesystem::__write(const char* path, const char* buf, size_t size, off_t of
 	return ret;
 }
 
-int Filesystem::__statfs(const char* path, struct statvfs* buf) noexcept
+int Filesystem::__writeBuf(const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* info) noexcept
 {
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::shared_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->statfs(path, buf);
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->writeBuf(st.st_ino, buf, offset, info);
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -132,15 +698,45 @@ int Filesystem::__statfs(const char* path, struct statvfs* buf) noexcept
 	return ret;
 }
 
-int Filesystem::__release(const char* path, struct fuse_file_info* info) noexcept
+ssize_t Filesystem::__copyFileRange(const char* pathIn, struct fuse_file_info* infoIn, off_t offsetIn, const char* pathOut,
+                                    struct fuse_file_info* infoOut, off_t offsetOut, size_t size, int flags) noexcept
+{
+	const RequestScope scope;
+
+	ssize_t ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
+
+		struct stat in{};
+		struct stat out{};
+
+		ret = flags ? -EINVAL : __this->resolve(pathIn, &in);
+		if (!ret)
+			ret = __this->resolve(pathOut, &out);
+		if (!ret)
+			ret = __this->copyFileRange(in.st_ino, offsetIn, infoIn, out.st_ino, offsetOut, infoOut, size);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	return ret;
+}
+
+int Filesystem::__statfs(const char* path, struct statvfs* buf) noexcept
 {
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::shared_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->release(path, info);
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->statfs(st.st_ino, buf);
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -148,16 +744,20 @@ int Filesystem::__release(const char* path, struct fuse_file_info* info) noexcep
 	return ret;
 }
 
-int Filesystem::__readdir(const char* path, void* buf, fuse_fill_dir_t cb, off_t offset, struct fuse_file_info* info,
-                          enum fuse_readdir_flags flags) noexcept
+int Filesystem::__release(const char* path, struct fuse_file_info* info) noexcept
 {
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::shared_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->readdir(path, buf, cb, offset, info, flags);
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->release(st.st_ino, info);
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -165,15 +765,20 @@ int Filesystem::__readdir(const char* path, void* buf, fuse_fill_dir_t cb, off_t
 	return ret;
 }
 
-int Filesystem::__create(const char* path, mode_t mode, struct fuse_file_info* info) noexcept
+int Filesystem::__flush(const char* path, struct fuse_file_info* info) noexcept
 {
+	const RequestScope scope;
+
 	int ret = -EIO;
 
 	try {
 		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
 
-		std::unique_lock<std::shared_mutex> lock(mutex_);
-		ret = __this->create(path, mode, info);
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->flush(st.st_ino, info);
 	} catch (const std::exception& e) {
 		std::cerr << "exception: " << e.what() << "\n";
 	}
@@ -181,9 +786,661 @@ int Filesystem::__create(const char* path, mode_t mode, struct fuse_file_info* i
 	return ret;
 }
 
-int Filesystem::main(std::span<char*> args)
+int Filesystem::__fsync(const char* path, int datasync, struct fuse_file_info* info) noexcept
 {
-	return fuse_main(args.size(), args.data(), &ops_, this);
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
+
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->fsync(st.st_ino, datasync, info);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	return ret;
+}
+
+int Filesystem::__fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
+
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->fallocate(st.st_ino, mode, offset, length, info);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	return ret;
+}
+
+int Filesystem::__opendir(const char* path, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
+
+		struct stat st{};
+
+		ret = __this->resolve(path, &st);
+		if (!ret)
+			ret = __this->openListing(st.st_ino, info);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	return ret;
+}
+
+int Filesystem::__readdir(const char* /* path */, void* buf, fuse_fill_dir_t cb, off_t offset, struct fuse_file_info* info,
+                          enum fuse_readdir_flags flags) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this  = static_cast<Filesystem*>(fuse_get_context()->private_data);
+		auto listing = reinterpret_cast<DirListing*>(info->fh);
+
+		ret = offset ? 0 : __this->list(*listing, info);
+
+		const auto fill = (flags & FUSE_READDIR_PLUS) ? FUSE_FILL_DIR_PLUS : static_cast<fuse_fill_dir_flags>(0);
+
+		for (auto i = static_cast<size_t>(offset); !ret && i < listing->entries_.size(); i++) {
+			const auto& entry = listing->entries_.at(i);
+
+			if (cb(buf, entry.name_.c_str(), &entry.st_, i + 1, fill))
+				break;
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	return ret;
+}
+
+int Filesystem::__releasedir(const char* /* path */, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
+
+	__this->closeListing(info);
+
+	return 0;
+}
+
+int Filesystem::__create(const char* path, mode_t mode, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_get_context()->private_data);
+
+		const auto name = rootEntry(path);
+
+		if (!name)
+			return -ENOENT;
+
+		struct stat st{};
+
+		ret = __this->create(FUSE_ROOT_ID, name, mode, &st, info);
+
+		info->keep_cache = 1;
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	return ret;
+}
+
+void Filesystem::__init(void* userdata, struct fuse_conn_info* conn) noexcept
+{
+	auto __this = static_cast<Filesystem*>(userdata);
+
+	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+	conn->max_write     = MAX_WRITE;
+	conn->max_readahead = MAX_WRITE;
+
+	if (__this->maxRead_)
+		conn->max_read = __this->maxRead_;
+
+	try {
+		__this->startInvalidations();
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+}
+
+void Filesystem::__lookup(fuse_req_t req, fuse_ino_t parent, const char* name) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+	struct fuse_entry_param entry{};
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->lookup(parent, name, &entry.attr);
+		__this->owner_.apply(&entry.attr);
+
+		// taken after the attributes: a file replaced meanwhile goes by
+		// its successor's generation, never the other way round
+		entry.generation = __this->generation(entry.attr.st_ino);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret == -ENOENT) {
+		// a negative entry, for the kernel to cache
+		entry               = {};
+		entry.entry_timeout = NEGATIVE_TIMEOUT;
+		fuse_reply_entry(req, &entry);
+	} else if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else {
+		entry.ino           = entry.attr.st_ino;
+		entry.attr_timeout  = ATTR_TIMEOUT;
+		entry.entry_timeout = ENTRY_TIMEOUT;
+		fuse_reply_entry(req, &entry);
+	}
+}
+
+void Filesystem::__forget(fuse_req_t req, fuse_ino_t /* ino */, uint64_t /* nlookup */) noexcept
+{
+	// Inode numbers are derived from directory slots, the generation tells
+	// reused ones apart: there is nothing to reclaim
+	fuse_reply_none(req);
+}
+
+void Filesystem::__rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname,
+                          unsigned int flags) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->rename(parent, name, newparent, newname, flags);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	fuse_reply_err(req, -ret);
+}
+
+void Filesystem::__getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* /* info */) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+	struct stat st{};
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->getattr(ino, &st);
+		__this->owner_.apply(&st);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+void Filesystem::__setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int toSet, struct fuse_file_info* /* info */) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+	struct stat st{};
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		// Only the size can be changed, the rest of the attributes are
+		// not backed by the directory entries
+		ret = 0;
+		if (toSet & FUSE_SET_ATTR_SIZE)
+			ret = __this->truncate(ino, attr->st_size);
+
+		if (!ret)
+			ret = __this->getattr(ino, &st);
+
+		__this->owner_.apply(&st);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_attr(req, &st, ATTR_TIMEOUT);
+}
+
+void Filesystem::__unlink(fuse_req_t req, fuse_ino_t parent, const char* name) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->unlink(parent, name);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	fuse_reply_err(req, -ret);
+}
+
+void Filesystem::__open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->open(ino, info);
+
+		// the page cache only goes stale through invalidate()
+		info->keep_cache = 1;
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_open(req, info);
+}
+
+void Filesystem::__read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret      = -EIO;
+	bool replied = false;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		// Reply straight from the disk image, spliced when the kernel allows it
+		ret = __this->readBuf(ino, size, offset, info, [req, &replied](struct fuse_bufvec* buf) {
+			replied = true;
+			return fuse_reply_data(req, buf, static_cast<fuse_buf_copy_flags>(0));
+		});
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (!replied)
+		fuse_reply_err(req, ret < 0 ? -ret : EIO);
+}
+
+void Filesystem::__writeBuf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->writeBuf(ino, buf, offset, info);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+void Filesystem::__copyFileRange(fuse_req_t req, fuse_ino_t inoIn, off_t offsetIn, struct fuse_file_info* infoIn, fuse_ino_t inoOut,
+                                 off_t offsetOut, struct fuse_file_info* infoOut, size_t size, int flags) noexcept
+{
+	const RequestScope scope;
+
+	ssize_t ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = flags ? -EINVAL : __this->copyFileRange(inoIn, offsetIn, infoIn, inoOut, offsetOut, infoOut, size);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_write(req, ret);
+}
+
+void Filesystem::__statfs(fuse_req_t req, fuse_ino_t ino) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+	struct statvfs st{};
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->statfs(ino, &st);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_statfs(req, &st);
+}
+
+void Filesystem::__release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->release(ino, info);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	fuse_reply_err(req, -ret);
+}
+
+void Filesystem::__flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->flush(ino, info);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	fuse_reply_err(req, -ret);
+}
+
+void Filesystem::__fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->fsync(ino, datasync, info);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	fuse_reply_err(req, -ret);
+}
+
+void Filesystem::__fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->fallocate(ino, mode, offset, length, info);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	fuse_reply_err(req, -ret);
+}
+
+void Filesystem::__opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->openListing(ino, info);
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else
+		fuse_reply_open(req, info);
+}
+
+void Filesystem::__readdir(fuse_req_t req, fuse_ino_t /* ino */, size_t size, off_t offset, struct fuse_file_info* info) noexcept
+{
+	replyListing(req, size, offset, info, false);
+}
+
+void Filesystem::__readdirplus(fuse_req_t req, fuse_ino_t /* ino */, size_t size, off_t offset, struct fuse_file_info* info) noexcept
+{
+	replyListing(req, size, offset, info, true);
+}
+
+void Filesystem::__releasedir(fuse_req_t req, fuse_ino_t /* ino */, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+	__this->closeListing(info);
+
+	fuse_reply_err(req, 0);
+}
+
+void Filesystem::__create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* info) noexcept
+{
+	const RequestScope scope;
+
+	int ret = -EIO;
+	struct fuse_entry_param entry{};
+
+	try {
+		auto __this = static_cast<Filesystem*>(fuse_req_userdata(req));
+
+		ret = __this->create(parent, name, mode, &entry.attr, info);
+		__this->owner_.apply(&entry.attr);
+
+		entry.generation = __this->generation(entry.attr.st_ino);
+		info->keep_cache = 1;
+	} catch (const std::exception& e) {
+		std::cerr << "exception: " << e.what() << "\n";
+	}
+
+	if (ret < 0)
+		fuse_reply_err(req, -ret);
+	else {
+		entry.ino           = entry.attr.st_ino;
+		entry.attr_timeout  = ATTR_TIMEOUT;
+		entry.entry_timeout = ENTRY_TIMEOUT;
+		fuse_reply_create(req, &entry, info);
+	}
+}
+
+int Filesystem::main(std::span<char*> args, Frontend frontend)
+{
+	struct fuse_args fargs = FUSE_ARGS_INIT(static_cast<int>(args.size()), args.data());
+
+	// Reads as large as the writes, unless asked otherwise; the kernel only
+	// learns of the size through the mount option
+	static const auto readSpec = std::to_array<struct fuse_opt>({FUSE_OPT_KEY("max_read=", 0), FUSE_OPT_END});
+
+	bool given = false;
+
+	const auto keep = [](void* data, const char* /* arg */, int key, struct fuse_args* /* outargs */) {
+		if (!key)
+			*static_cast<bool*>(data) = true;
+
+		return 1;
+	};
+
+	if (fuse_opt_parse(&fargs, &given, readSpec.data(), keep) < 0
+	    || (!given && fuse_opt_add_arg(&fargs, std::format("-omax_read={}", MAX_WRITE).c_str()) < 0)) {
+		fuse_opt_free_args(&fargs);
+		return EXIT_FAILURE;
+	}
+
+	maxRead_ = given ? 0 : MAX_WRITE;
+
+	const auto ret = frontend == Frontend::LowLevel ? mainLowLevel(std::span(fargs.argv, fargs.argc))
+	                                                : fuse_main(fargs.argc, fargs.argv, &ops_, this);
+
+	fuse_opt_free_args(&fargs);
+
+	return ret;
+}
+
+int Filesystem::mainLowLevel(std::span<char*> args)
+{
+	struct fuse_args fargs = FUSE_ARGS_INIT(static_cast<int>(args.size()), args.data());
+	struct fuse_cmdline_opts opts{};
+
+	// uid= and gid= are high-level API options, emulate them here
+	// clang-format off
+	static const auto ownerSpec = std::to_array<struct fuse_opt>({
+		{"uid="   , offsetof(Owner, setUid_), 1},
+		{"uid=%u" , offsetof(Owner, uid_)   , 0},
+		{"gid="   , offsetof(Owner, setGid_), 1},
+		{"gid=%u" , offsetof(Owner, gid_)   , 0},
+		FUSE_OPT_END
+	});
+	// clang-format on
+
+	if (fuse_opt_parse(&fargs, &owner_, ownerSpec.data(), nullptr) < 0 || fuse_parse_cmdline(&fargs, &opts) != 0) {
+		fuse_opt_free_args(&fargs);
+		return EXIT_FAILURE;
+	}
+
+	int ret = -1;
+
+	if (!opts.mountpoint)
+		std::cerr << "Error: no mountpoint specified\n";
+	else {
+		auto se = fuse_session_new(&fargs, &llops_, sizeof(llops_), this);
+
+		if (se) {
+			session_ = se;
+
+			if (!fuse_set_signal_handlers(se)) {
+				if (!fuse_session_mount(se, opts.mountpoint)) {
+					fuse_daemonize(opts.foreground);
+
+					if (opts.singlethread)
+						ret = fuse_session_loop(se);
+					else
+						ret = fuse_session_loop_mt(se, opts.clone_fd);
+
+					fuse_session_unmount(se);
+				}
+				fuse_remove_signal_handlers(se);
+			}
+			fuse_session_destroy(se);
+			session_ = nullptr;
+		}
+	}
+
+	free(opts.mountpoint);
+	fuse_opt_free_args(&fargs);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int Filesystem::read(fuse_ino_t ino, char* buf, size_t size, off_t offset, struct fuse_file_info* info)
+{
+	auto dst = FUSE_BUFVEC_INIT(size);
+
+	dst.buf[0].mem = buf;
+
+	return readBuf(ino, size, offset, info, [&dst](struct fuse_bufvec* src) {
+		return static_cast<int>(fuse_buf_copy(&dst, src, static_cast<fuse_buf_copy_flags>(0)));
+	});
+}
+
+int Filesystem::write(fuse_ino_t ino, const char* buf, size_t size, off_t offset, struct fuse_file_info* info)
+{
+	auto src = FUSE_BUFVEC_INIT(size);
+
+	src.buf[0].mem = const_cast<char*>(buf);
+
+	return writeBuf(ino, &src, offset, info);
+}
+
+ssize_t Filesystem::copyFileRange(fuse_ino_t inoIn, off_t offsetIn, struct fuse_file_info* infoIn, fuse_ino_t inoOut, off_t offsetOut,
+                                  struct fuse_file_info* infoOut, size_t size)
+{
+	// Bounce through memory, for the copies a filesystem cannot make in place
+	std::pmr::vector<char> buf(std::min<size_t>(size, MAX_WRITE), arena());
+	size_t done = 0;
+
+	while (done < size) {
+		const auto n = read(inoIn, buf.data(), std::min(buf.size(), size - done), offsetIn + done, infoIn);
+		if (n <= 0)
+			return done ? static_cast<ssize_t>(done) : n;
+
+		const auto written = write(inoOut, buf.data(), n, offsetOut + done, infoOut);
+		if (written < 0)
+			return done ? static_cast<ssize_t>(done) : written;
+
+		done += written;
+
+		if (written < n)
+			break;
+	}
+
+	return done;
 }
 
 void Filesystem::dumpFAT() const
@@ -1,62 +1,358 @@
 // SPDX-License-Identifier: GPL-2.0
 #pragma once
 
+#include <array>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
 #include <shared_mutex>
 #include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 #include <fuse3/fuse.h>
+#include <fuse3/fuse_lowlevel.h>
+
+class Disk;
 
 class Filesystem {
+public:
+	enum class Frontend {
+		HighLevel, // path-based fuse_operations
+		LowLevel   // inode-based fuse_lowlevel_ops
+	};
+
+private:
+	// Nothing but this process changes the image, so the kernel may keep
+	// entries and attributes for long; see invalidate()
+	static constexpr double ENTRY_TIMEOUT = 60.0;
+	static constexpr double ATTR_TIMEOUT  = 60.0;
+
+	// Only names created through this process can appear, and those
+	// replace the kernel's negative entries
+	static constexpr double NEGATIVE_TIMEOUT = 60.0;
+
+	// Bound of the negative lookup cache, it is emptied when full
+	static constexpr size_t MAX_MISSES = 1024;
+
+	// Closed directory listings kept for reuse by the next opendir
+	static constexpr size_t MAX_LISTINGS = 16;
+
+	// Largest write request the kernel is asked to send, libfuse clamps it
+	// to its receive buffer. Reads are asked for in the same size.
+	static constexpr unsigned int MAX_WRITE = 1024 * 1024;
+
+	// Scratch memory of each thread for handling requests, enough for a
+	// copy_file_range() bounce buffer along with the sector buffers
+	static constexpr size_t ARENA_SIZE = 2 * MAX_WRITE;
+
+	struct Arena;
+	static thread_local Arena arena_;
+
+	// File ownership requested through -o uid=,gid= (low-level frontend only)
+	struct Owner {
+		unsigned int uid_{};
+		unsigned int gid_{};
+		int setUid_{};
+		int setGid_{};
+
+		void apply(struct stat* buf) const
+		{
+			if (setUid_)
+				buf->st_uid = uid_;
+
+			if (setGid_)
+				buf->st_gid = gid_;
+		}
+	};
+
+	// Stream of an open directory, kept in fuse_file_info::fh. Offsets are
+	// indexes in the entries, sorted by name and rebuilt at offset 0.
+	struct DirListing {
+		struct Entry {
+			std::string name_;
+			struct stat st_{};
+		};
+
+		fuse_ino_t ino_{};
+		std::vector<Entry> entries_;
+	};
+
+	// Queued kernel cache invalidation
+	struct Invalidation {
+		fuse_ino_t ino_{};
+		std::string path_;
+		bool data_{};
+	};
+
+	// Lets misses_ be searched for the names requests come with
+	struct MissHash {
+		using is_transparent = void;
+
+		size_t operator()(std::string_view name) const noexcept
+		{
+			return std::hash<std::string_view>{}(name);
+		}
+	};
+
 	struct fuse_operations ops_{};
-	inline static std::shared_mutex mutex_;
+	struct fuse_lowlevel_ops llops_{};
+	Owner owner_;
+	// what main() passed on as -o max_read=, zero when the command line
+	// had its own
+	unsigned int maxRead_{};
+	std::array<std::shared_mutex, 64> fileMutexes_;
+	struct fuse* fuse_{};
+	struct fuse_session* session_{};
+	std::mutex invalidationMutex_;
+	std::condition_variable_any invalidationCond_;
+	std::vector<Invalidation> invalidations_;
+	std::jthread invalidationThread_;
+	std::mutex listingsMutex_;
+	std::vector<std::unique_ptr<DirListing>> listings_;
+	// names are short enough to be held inline, so the set only allocates
+	// nodes, which go back to the pool when it gets emptied
+	std::pmr::unsynchronized_pool_resource missesPool_;
+	std::pmr::unordered_set<std::pmr::string, MissHash, std::equal_to<>> misses_{&missesPool_};
+	unsigned long missesGeneration_{};
+	std::shared_mutex missesMutex_;
+
+	int resolve(const char* path, struct stat* buf);
+
+	// The name of the root directory entry path stands for, within path;
+	// nullptr for the root itself or anything below an entry
+	static const char* rootEntry(const char* path);
+
+	int mainLowLevel(std::span<char*> args);
+
+	void startInvalidations();
+
+	void stopInvalidations();
+
+	void invalidationLoop(std::stop_token stoken);
+
+	int openListing(fuse_ino_t ino, struct fuse_file_info* info);
+
+	int list(DirListing& listing, struct fuse_file_info* info);
+
+	void closeListing(struct fuse_file_info* info);
+
+	static int fillListing(void* buf, const char* name, const struct stat* st, off_t offset, enum fuse_fill_dir_flags flags);
+
+	static void replyListing(fuse_req_t req, size_t size, off_t offset, struct fuse_file_info* info, bool plus) noexcept;
+
+	static void* __init(struct fuse_conn_info* conn, struct fuse_config* cfg) noexcept;
+
+	static void __destroy(void* userdata) noexcept;
 
 	static int __getattr(const char* path, struct stat* buf, struct fuse_file_info* info) noexcept;
 
 	static int __unlink(const char* path) noexcept;
 
+	static int __rename(const char* from, const char* to, unsigned int flags) noexcept;
+
 	static int __truncate(const char* path, off_t length, struct fuse_file_info* info) noexcept;
 
+	static int __utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* info) noexcept;
+
 	static int __open(const char* path, struct fuse_file_info* info) noexcept;
 
 	static int __read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* info) noexcept;
 
-	static int __write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* info) noexcept;
+	static int __readBuf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* info) noexcept;
+
+	static int __writeBuf(const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* info) noexcept;
+
+	static ssize_t __copyFileRange(const char* pathIn, struct fuse_file_info* infoIn, off_t offsetIn, const char* pathOut,
+	                               struct fuse_file_info* infoOut, off_t offsetOut, size_t size, int flags) noexcept;
 
 	static int __statfs(const char* path, struct statvfs* buf) noexcept;
 
 	static int __release(const char* path, struct fuse_file_info* info) noexcept;
 
+	static int __flush(const char* path, struct fuse_file_info* info) noexcept;
+
+	static int __fsync(const char* path, int datasync, struct fuse_file_info* info) noexcept;
+
+	static int __fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* info) noexcept;
+
+	static int __opendir(const char* path, struct fuse_file_info* info) noexcept;
+
 	static int __readdir(const char* path, void* buf, fuse_fill_dir_t cb, off_t offset, struct fuse_file_info* info,
 	                     enum fuse_readdir_flags flags) noexcept;
 
+	static int __releasedir(const char* path, struct fuse_file_info* info) noexcept;
+
 	static int __create(const char* path, mode_t mode, struct fuse_file_info* info) noexcept;
 
+	static void __init(void* userdata, struct fuse_conn_info* conn) noexcept;
+
+	static void __lookup(fuse_req_t req, fuse_ino_t parent, const char* name) noexcept;
+
+	static void __forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) noexcept;
+
+	static void __getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept;
+
+	static void __setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int toSet, struct fuse_file_info* info) noexcept;
+
+	static void __unlink(fuse_req_t req, fuse_ino_t parent, const char* name) noexcept;
+
+	static void __rename(fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname,
+	                     unsigned int flags) noexcept;
+
+	static void __open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept;
+
+	static void __read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* info) noexcept;
+
+	static void __writeBuf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* info) noexcept;
+
+	static void __copyFileRange(fuse_req_t req, fuse_ino_t inoIn, off_t offsetIn, struct fuse_file_info* infoIn, fuse_ino_t inoOut,
+	                            off_t offsetOut, struct fuse_file_info* infoOut, size_t size, int flags) noexcept;
+
+	static void __statfs(fuse_req_t req, fuse_ino_t ino) noexcept;
+
+	static void __release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept;
+
+	static void __flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept;
+
+	static void __fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* info) noexcept;
+
+	static void __fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* info) noexcept;
+
+	static void __opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept;
+
+	static void __readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* info) noexcept;
+
+	static void __readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* info) noexcept;
+
+	static void __releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* info) noexcept;
+
+	static void __create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* info) noexcept;
+
+protected:
+	// Guards the directory entries and the block allocation. Operations
+	// needing both locks take the file lock first.
+	std::shared_mutex dirMutex_;
+
+	// Memory for what lives no longer than the request being handled, see
+	// RequestScope. Outside of any, it is the default resource.
+	static std::pmr::memory_resource* arena();
+
+	// Guards the data blocks of a file
+	std::shared_mutex& fileMutex(fuse_ino_t ino)
+	{
+		return fileMutexes_.at(ino % fileMutexes_.size());
+	}
+
+	// Drops the attributes the kernel caches for a file changed behind its
+	// back, and its pages as well when data is set. The name is the path the
+	// high-level frontend knows it by, an empty one being the root directory.
+	// The notification is sent from a worker thread since the kernel may hold
+	// locks the current request depends on.
+	void invalidate(fuse_ino_t ino, const std::string& name, bool data);
+
+	// Negative lookup cache. Unless name is known not to exist, missed()
+	// returns the generation to hand to rememberMiss() once the lookup
+	// failed; forgetMisses() must follow publishing any new name.
+	bool missed(const std::string& name, unsigned long& generation);
+
+	void rememberMiss(const std::string& name, unsigned long generation);
+
+	void forgetMisses();
+
 public:
+	// Marks the handling of one request on the current thread: the memory
+	// taken from arena() meanwhile is given back once the outermost scope
+	// ends, which the callbacks make sure happens after replying
+	class RequestScope {
+	public:
+		RequestScope() noexcept;
+
+		~RequestScope();
+
+		RequestScope(const RequestScope&) = delete;
+
+		RequestScope& operator=(const RequestScope&) = delete;
+	};
+
+	// Allocations arena() passed on to the heap, all threads together; the
+	// ones made outside of it are not counted. It stays put while requests
+	// fit into ARENA_SIZE, and gets reported when unmounting otherwise.
+	static unsigned long arenaSpills();
+
+	// Global heap allocations made within a RequestScope, all threads
+	// together. Once warmed up, requests that only read the image make none;
+	// those changing the directory allocate its next snapshot, and held
+	// writes their data. Only counted when built with COUNT_ALLOCATIONS, and
+	// reported when unmounting then; zero otherwise.
+	static unsigned long requestAllocations();
+
 	Filesystem();
 
 	virtual ~Filesystem() = default;
 
-	int main(std::span<char*> args);
+	// type is one of cpm, hc; nullptr for any other
+	static std::unique_ptr<Filesystem> create(std::string_view type, Disk* disk, bool staging = false);
+
+	int main(std::span<char*> args, Frontend frontend = Frontend::HighLevel);
+
+	virtual int lookup(fuse_ino_t parent, const char* name, struct stat* buf) = 0;
+
+	virtual int getattr(fuse_ino_t ino, struct stat* buf) = 0;
+
+	// Changes each time the inode number goes to another file, for the
+	// kernel to tell a reused number from the file it still has open
+	virtual uint64_t generation(fuse_ino_t ino) = 0;
+
+	virtual int unlink(fuse_ino_t parent, const char* name) = 0;
+
+	// flags: 0 or RENAME_NOREPLACE
+	virtual int rename(fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname, unsigned int flags) = 0;
+
+	virtual int truncate(fuse_ino_t ino, off_t length) = 0;
+
+	virtual int open(fuse_ino_t ino, struct fuse_file_info* info) = 0;
+
+	virtual int read(fuse_ino_t ino, char* buf, size_t size, off_t offset, struct fuse_file_info* info);
+
+	virtual int write(fuse_ino_t ino, const char* buf, size_t size, off_t offset, struct fuse_file_info* info);
+
+	// Calls reply with buffers over the data, valid until it returns, and
+	// returns what reply returned
+	virtual int readBuf(fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* info,
+	                    const std::function<int(struct fuse_bufvec*)>& reply)
+	    = 0;
 
-	virtual int getattr(const char* path, struct stat* buf, struct fuse_file_info* info) = 0;
+	virtual int writeBuf(fuse_ino_t ino, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* info) = 0;
 
-	virtual int unlink(const char* path) = 0;
+	// Copies within the image, without the data going through the kernel
+	virtual ssize_t copyFileRange(fuse_ino_t inoIn, off_t offsetIn, struct fuse_file_info* infoIn, fuse_ino_t inoOut, off_t offsetOut,
+	                              struct fuse_file_info* infoOut, size_t size);
 
-	virtual int truncate(const char* path, off_t length, struct fuse_file_info* info) = 0;
+	virtual int statfs(fuse_ino_t ino, struct statvfs* buf) = 0;
 
-	virtual int open(const char* path, struct fuse_file_info* info) = 0;
+	// Blocks of statfs() one directory entry holds, larger files take
+	// several entries
+	virtual unsigned int blocksPerEntry() const = 0;
 
-	virtual int read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* info) = 0;
+	virtual int release(fuse_ino_t ino, struct fuse_file_info* info) = 0;
 
-	virtual int write(const char* path, const char* buf, size_t size, off_t offset, struct fuse_file_info* info) = 0;
+	virtual int flush(fuse_ino_t ino, struct fuse_file_info* info) = 0;
 
-	virtual int statfs(const char* path, struct statvfs* buf) = 0;
+	virtual int fsync(fuse_ino_t ino, int datasync, struct fuse_file_info* info) = 0;
 
-	virtual int release(const char* path, struct fuse_file_info* info) = 0;
+	// Gives the file its blocks up to offset + length in one go
+	virtual int fallocate(fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info* info) = 0;
 
-	virtual int readdir(const char* path, void* buf, fuse_fill_dir_t cb, off_t offset, struct fuse_file_info* info, enum fuse_readdir_flags flags)
+	virtual int readdir(fuse_ino_t ino, void* buf, fuse_fill_dir_t cb, off_t offset, struct fuse_file_info* info, enum fuse_readdir_flags flags)
 	    = 0;
 
-	virtual int create(const char* path, mode_t mode, struct fuse_file_info* info) = 0;
+	virtual int create(fuse_ino_t parent, const char* name, mode_t mode, struct stat* buf, struct fuse_file_info* info) = 0;
 
 	virtual void dumpFAT() const;
 
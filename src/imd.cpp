@@ -1,11 +1,13 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <algorithm>
 #include <array>
+#include <cerrno>
 #include <ctime>
 #include <format>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 
@@ -120,8 +122,65 @@ IMD::IMD(const fs::path& path)
 	}
 }
 
+IMD::IMD(const DiskProperties& properties)
+    : properties_{properties}
+{
+	if (properties_.tracks() > 0x100 || properties_.heads() > 2 || properties_.sectors() > 0xff
+	    || size2ss(properties_.sectorSize()) == SectorSize::SS_INVALID)
+		throw std::runtime_error("unsupported geometry");
+
+	const Sector fill(std::vector<unsigned char>(properties_.sectorSize(), 0xe5));
+
+	tracks_.reserve(properties_.tracks() * properties_.heads());
+
+	for (unsigned int c = 0; c < properties_.tracks(); c++) {
+		for (unsigned int h = 0; h < properties_.heads(); h++) {
+			tracks_.push_back(blankTrack(c, h, fill));
+			mapTrack(tracks_.back());
+		}
+	}
+
+	modified_ = true;
+}
+
+IMD::Track IMD::blankTrack(unsigned char cylinder, unsigned char head, const Sector& fill) const
+{
+	Track ret;
+
+	if (tracks_.empty())
+		ret.mode_ = DataTransferRate::DTR_250_MFM;
+	else
+		ret.mode_ = tracks_.front().mode_;
+
+	ret.cylinder_ = cylinder;
+	ret.head_     = head;
+	ret.nsectors_ = properties_.sectors();
+	ret.ssize_    = size2ss(properties_.sectorSize());
+
+	if (tracks_.empty()) {
+		ret.numberingMap_.resize(ret.nsectors_);
+		for (unsigned char i = 0; i < ret.nsectors_; i++)
+			ret.numberingMap_[i] = i + 1;
+	} else
+		ret.numberingMap_ = tracks_.front().numberingMap_;
+
+	ret.sectors_.assign(ret.nsectors_, fill);
+
+	return ret;
+}
+
+void IMD::mapTrack(Track& track)
+{
+	for (unsigned int i = 0; i < track.nsectors_; i++) {
+		DiskPos dpos(properties_, track.cylinder_, track.head_, track.numberingMap_[i] - 1);
+		sectors_[dpos.pos()] = &track.sectors_[i];
+	}
+}
+
 const Sector& IMD::read(unsigned int pos) const
 {
+	std::shared_lock<std::shared_mutex> lock(mutex_);
+
 	auto it = sectors_.find(pos);
 	if (it != sectors_.end())
 		return *it->second;
@@ -130,66 +189,74 @@ const Sector& IMD::read(unsigned int pos) const
 	return empty;
 }
 
-void IMD::write(unsigned int pos, const Sector& sector)
+std::expected<void, int> IMD::write(unsigned int pos, const Sector& sector)
 {
 	if (pos > properties_.maxPos())
-		throw std::runtime_error(std::format("invalid sector position: {} (max: {})", pos, properties_.maxPos()));
+		return std::unexpected(-EINVAL);
 
 	if (!sector.data().empty() && sector.data().size() != properties_.sectorSize())
-		throw std::runtime_error(std::format("invalid sector size: {} (expected: {})", sector.data().size(), properties_.sectorSize()));
+		return std::unexpected(-EINVAL);
+
+	// Sectors of an existing track are updated in place, only adding a
+	// track has to keep the readers out
+	std::shared_lock<std::shared_mutex> sharedLock(mutex_);
+	std::unique_lock<std::shared_mutex> lock(mutex_, std::defer_lock);
 
 	auto it = sectors_.find(pos);
+	if (it == sectors_.end()) {
+		sharedLock.unlock();
+		lock.lock();
+		it = sectors_.find(pos);
+	}
+
 	if (it != sectors_.end())
 		*it->second = sector;
 	else {
 		DiskPos dpos(properties_, pos);
 
-		Track track;
+		if (size2ss(sector.data().size()) == SectorSize::SS_INVALID)
+			return std::unexpected(-EINVAL);
 
-		if (tracks_.empty())
-			track.mode_ = DataTransferRate::DTR_250_MFM;
-		else
-			track.mode_ = tracks_.front().mode_;
+		auto track = blankTrack(dpos.track(), dpos.head(), {});
 
-		track.cylinder_ = dpos.track();
-		track.head_     = dpos.head();
-		track.nsectors_ = properties_.sectors();
+		track.sectors_[dpos.sector()] = sector;
 
-		track.ssize_ = size2ss(sector.data().size());
-		if (track.ssize_ == SectorSize::SS_INVALID)
-			throw std::runtime_error(std::format("unsupported sector size: {}", sector.data().size()));
+		tracks_.push_back(std::move(track));
+		mapTrack(tracks_.back());
+	}
 
-		if (tracks_.empty()) {
-			track.numberingMap_.resize(track.nsectors_);
-			for (unsigned char i = 0; i < track.nsectors_; i++)
-				track.numberingMap_.at(i) = i + 1;
-		} else
-			track.numberingMap_ = tracks_.front().numberingMap_;
+	modified_ = true;
 
-		track.sectors_.resize(track.nsectors_);
-		track.sectors_.at(dpos.sector()) = sector;
+	return {};
+}
 
-		for (unsigned int i = 0; i < track.nsectors_; i++) {
-			DiskPos __dpos(properties_, track.cylinder_, track.head_, track.numberingMap_.at(i) - 1);
-			sectors_[__dpos.pos()] = &track.sectors_.at(i);
-		}
+std::expected<std::span<unsigned char>, int> IMD::modify(unsigned int pos)
+{
+	{
+		std::shared_lock<std::shared_mutex> lock(mutex_);
 
-		tracks_.push_back(std::move(track));
+		auto it = sectors_.find(pos);
+		if (it != sectors_.end() && it->second->data().size() == properties_.sectorSize()) {
+			modified_ = true;
+			return it->second->data();
+		}
 	}
 
-	modified_ = true;
+	const auto ret = write(pos, Sector(std::vector<unsigned char>(properties_.sectorSize(), 0xe5)));
+	if (!ret)
+		return std::unexpected(ret.error());
+
+	std::shared_lock<std::shared_mutex> lock(mutex_);
+
+	return sectors_.find(pos)->second->data();
 }
 
-void IMD::save(const fs::path& path) const
+void IMD::save(std::ostream& of) const
 {
 	const auto now = std::time(nullptr);
 	struct tm result{};
 	auto __tm = localtime_r(&now, &result);
 
-	std::ofstream of(path, std::ios_base::trunc);
-	if (!of)
-		throw std::runtime_error(std::format("failed to write {}", path.string()));
-
 	// clang-format off
 	of << "IMD 1.17: "
 	   << std::setw(2) << std::setfill('0') << __tm->tm_mon << "/"
@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0
 #pragma once
 
+#include <atomic>
 #include <filesystem>
 #include <map>
+#include <shared_mutex>
 #include <vector>
 
 #include "disk.h"
@@ -49,7 +51,8 @@ class IMD final : public Disk {
 	DiskProperties properties_;
 	std::vector<Track> tracks_;
 	std::map<unsigned int, Sector*> sectors_;
-	bool modified_{};
+	std::atomic<bool> modified_{};
+	mutable std::shared_mutex mutex_;
 
 	static unsigned int ss2size(SectorSize ss)
 	{
@@ -84,6 +87,11 @@ class IMD final : public Disk {
 		return size;
 	}
 
+	// A track of the disk's geometry, all sectors set to fill
+	Track blankTrack(unsigned char cylinder, unsigned char head, const Sector& fill) const;
+
+	void mapTrack(Track& track);
+
 	static SectorSize size2ss(unsigned int size)
 	{
 		SectorSize ssize = SectorSize::SS_INVALID;
@@ -120,6 +128,9 @@ class IMD final : public Disk {
 public:
 	IMD(const fs::path& path);
 
+	// A blank disk of the given geometry, formatted with 0xe5
+	IMD(const DiskProperties& properties);
+
 	~IMD() override = default;
 
 	const DiskProperties& properties() const override
@@ -129,9 +140,13 @@ public:
 
 	const Sector& read(unsigned int pos) const override;
 
-	void write(unsigned int pos, const Sector& sector) override;
+	std::expected<void, int> write(unsigned int pos, const Sector& sector) override;
+
+	std::expected<std::span<unsigned char>, int> modify(unsigned int pos) override;
+
+	using Disk::save;
 
-	void save(const fs::path& path) const override;
+	void save(std::ostream& of) const override;
 
 	bool modified() const override
 	{
@@ -5,9 +5,9 @@
 #include <iostream>
 #include <string_view>
 
-#include "cpmfs.h"
+#include "commands.h"
 #include "disk.h"
-#include "hcfs.h"
+#include "filesystem.h"
 #include "version.h"
 
 static void version()
@@ -21,7 +21,10 @@ static void help(const char* progname)
 	version();
 	std::cout << "Usage: " << progname << " [options] <mountpoint>\n";
 	std::cout << "    --file=<disk-image>    The path to the disk image to load\n";
-	std::cout << "    --filesystem=<fs>      The filesystem type (cpm, hc (default))\n\n";
+	std::cout << "    --filesystem=<fs>      The filesystem type (cpm, hc (default))\n";
+	std::cout << "    --frontend=<fe>        The FUSE API to use (hl (default), ll)\n";
+	std::cout << "    --staging              Hold open files whole in memory\n\n";
+	Commands::help(progname);
 }
 
 int main(int argc, char* argv[])
@@ -29,6 +32,8 @@ int main(int argc, char* argv[])
 	struct {
 		char* file_{};
 		char* filesystem_{};
+		char* frontend_{};
+		int staging_{};
 		int help_{};
 		int version_{};
 	} options;
@@ -37,6 +42,8 @@ int main(int argc, char* argv[])
 	static const auto optionSpec = std::to_array<struct fuse_opt>({
 		{"--file=%s"      , offsetof(decltype(options), file_)      , 0},
 		{"--filesystem=%s", offsetof(decltype(options), filesystem_), 0},
+		{"--frontend=%s"  , offsetof(decltype(options), frontend_)  , 0},
+		{"--staging"      , offsetof(decltype(options), staging_)   , 1},
 		{"-h"             , offsetof(decltype(options), help_)      , 1},
 		{"--help"         , offsetof(decltype(options), help_)      , 1},
 		{"-V"             , offsetof(decltype(options), version_)   , 1},
@@ -45,6 +52,9 @@ int main(int argc, char* argv[])
 	});
 	// clang-format on
 
+	if (argc > 1 && Commands::known(argv[1]))
+		return Commands::run(std::span(argv, argc));
+
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
 	if (fuse_opt_parse(&args, &options, optionSpec.data(), nullptr) < 0)
@@ -84,18 +94,28 @@ int main(int argc, char* argv[])
 		options.filesystem_   = defaultFs.data();
 	}
 
-	std::unique_ptr<Filesystem> fs;
+	if (!options.frontend_) {
+		static auto defaultFe = std::to_array("hl");
+		options.frontend_     = defaultFe.data();
+	}
+
+	auto frontend = Filesystem::Frontend::HighLevel;
+
+	if (std::string_view(options.frontend_) == "ll")
+		frontend = Filesystem::Frontend::LowLevel;
+	else if (std::string_view(options.frontend_) != "hl") {
+		std::cerr << "Error: unsupported frontend \"" << options.frontend_ << "\"\n";
+		return EXIT_FAILURE;
+	}
+
+	auto fs = Filesystem::create(options.filesystem_, disk.get(), options.staging_);
 
-	if (std::string_view(options.filesystem_) == "cpm")
-		fs = std::make_unique<CPMFS>(disk.get());
-	else if (std::string_view(options.filesystem_) == "hc")
-		fs = std::make_unique<HCFS>(disk.get());
-	else {
+	if (!fs) {
 		std::cerr << "Error: unsupported filesystem \"" << options.filesystem_ << "\"\n";
 		return EXIT_FAILURE;
 	}
 
-	ret = fs->main(std::span(args.argv, args.argc));
+	ret = fs->main(std::span(args.argv, args.argc), frontend);
 	fs.reset();
 
 	if (disk->modified())
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Directory names laid out for matching one name against a whole table at
+// once. A key holds the decoded name zero padded, followed by its length
+// and whether the slot starts a file, so that whole keys compare equal
+// exactly when the names do.
+class NameKeys {
+	static constexpr size_t KEY_SIZE = 16;
+
+	struct alignas(KEY_SIZE) Key {
+		std::array<unsigned char, KEY_SIZE> bytes_{};
+	};
+
+	std::vector<Key> keys_;
+
+	static std::optional<Key> key(const std::string& name)
+	{
+		if (name.size() > KEY_SIZE - 2)
+			return {};
+
+		Key ret;
+
+		std::memcpy(ret.bytes_.data(), name.data(), name.size());
+		ret.bytes_.at(KEY_SIZE - 2) = name.size();
+		ret.bytes_.at(KEY_SIZE - 1) = 1;
+
+		return ret;
+	}
+
+public:
+	void resize(size_t size)
+	{
+		keys_.resize(size);
+	}
+
+	// name: the file name as decoded from its first extent
+	void set(size_t slot, const std::string& name)
+	{
+		keys_.at(slot) = key(name).value_or(Key{});
+	}
+
+	void clear(size_t slot)
+	{
+		keys_.at(slot) = {};
+	}
+
+	std::optional<unsigned int> find(const std::string& name) const
+	{
+		const auto probe = key(name);
+
+		if (!probe)
+			return {};
+
+		size_t i = 0;
+
+#if defined(__AVX2__)
+		// two keys per comparison
+		const auto probe2 = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(probe->bytes_.data())));
+
+		for (; i + 2 <= keys_.size(); i += 2) {
+			const auto keys         = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys_.at(i).bytes_.data()));
+			const unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(keys, probe2));
+
+			if ((mask & 0xffff) == 0xffff)
+				return i;
+
+			if ((mask >> 16) == 0xffff)
+				return i + 1;
+		}
+#endif
+
+#if defined(__SSE2__)
+		const auto probe1 = _mm_load_si128(reinterpret_cast<const __m128i*>(probe->bytes_.data()));
+
+		for (; i < keys_.size(); i++) {
+			const auto key = _mm_load_si128(reinterpret_cast<const __m128i*>(keys_.at(i).bytes_.data()));
+
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(key, probe1)) == 0xffff)
+				return i;
+		}
+#endif
+
+		for (; i < keys_.size(); i++) {
+			if (keys_.at(i).bytes_ == probe->bytes_)
+				return i;
+		}
+
+		return {};
+	}
+};
@@ -18,4 +18,9 @@ public:
 	{
 		return data_;
 	}
+
+	auto& data()
+	{
+		return data_;
+	}
 };
@@ -0,0 +1,51 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <algorithm>
+
+#include "workpool.h"
+
+WorkPool::WorkPool(unsigned int threads) : queues_(std::max(threads, 1u))
+{
+}
+
+void WorkPool::add(Task task)
+{
+	queues_[next_++ % queues_.size()].tasks_.push_back(std::move(task));
+}
+
+std::optional<WorkPool::Task> WorkPool::take(unsigned int self)
+{
+	for (unsigned int i = 0; i < queues_.size(); i++) {
+		auto& queue = queues_[(self + i) % queues_.size()];
+
+		std::lock_guard<std::mutex> lock(queue.mutex_);
+
+		if (queue.tasks_.empty())
+			continue;
+
+		// its own tasks in order, the others' from the far end
+		auto& task = i ? queue.tasks_.back() : queue.tasks_.front();
+		auto ret   = std::move(task);
+
+		if (i)
+			queue.tasks_.pop_back();
+		else
+			queue.tasks_.pop_front();
+
+		return ret;
+	}
+
+	// no task gets added while running, so all have been taken
+	return {};
+}
+
+void WorkPool::run()
+{
+	std::vector<std::jthread> threads;
+
+	for (unsigned int i = 0; i < queues_.size(); i++) {
+		threads.emplace_back([this, i] {
+			while (auto task = take(i))
+				(*task)();
+		});
+	}
+}
@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-2.0
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Runs a batch of independent tasks on a fixed set of threads. Each thread
+// works through a deque of its own from the front and, once it ran dry,
+// steals from the back of the others, so that a few long tasks do not
+// leave the rest of the threads idle.
+class WorkPool {
+public:
+	using Task = std::function<void()>;
+
+private:
+	struct Queue {
+		std::deque<Task> tasks_;
+		std::mutex mutex_;
+	};
+
+	std::vector<Queue> queues_;
+	unsigned int next_{};
+
+	std::optional<Task> take(unsigned int self);
+
+public:
+	explicit WorkPool(unsigned int threads = std::thread::hardware_concurrency());
+
+	// Tasks are dealt out in turn, the first ones get picked up first
+	void add(Task task);
+
+	// Returns once all tasks have completed, which must not throw
+	void run();
+};